@@ -7,6 +7,7 @@
 const char version_arg [] = "version";
 const char help_arg [] = "help";
 const char verbose_arg [] = "verbose";
+const char stats_arg [] = "stats";
 const char altscr_arg [] = "altscr";
 const char class_arg [] = "class";
 const char font_arg [] = "font";
@@ -145,6 +146,12 @@ int args_parse(char **argv, uint argn)
                 a_flags |= FlagVerbose;
                 continue;
             }
+            /* --stats */
+            if (strcmp(cur.name, stats_arg) == 0)
+            {
+                a_flags |= FlagStats;
+                continue;
+            }
             /* --altscr */
             if (strcmp(cur.name, altscr_arg) == 0)
             {
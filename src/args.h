@@ -13,7 +13,8 @@ typedef enum {
     FlagRaw            = (1 << 2),  /* print uncolorized info */
     FlagAllowAltScreen = (1 << 3),  /* alt screens */
     FlagFixedGeometry  = (1 << 4),  /* is fixed geometry? */
-    FlagVerbose        = (1 << 5)
+    FlagVerbose        = (1 << 5),
+    FlagStats          = (1 << 6)   /* print load times and cache statistics */
 } ArgsFlags;
 
 
@@ -33,6 +34,7 @@ extern char *a_title;
 extern const char version_arg[];
 extern const char help_arg[];
 extern const char verbose_arg[];
+extern const char stats_arg[];
 extern const char altscr_arg[];
 extern const char class_arg[];
 extern const char font_arg[];
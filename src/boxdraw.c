@@ -0,0 +1,467 @@
+/* See LICENSE file for copyright and license details. */
+
+#include "boxdraw.h"
+
+
+/* line styles of an arm */
+#define NONE    0
+#define LIGHT   1
+#define HEAVY   2
+#define DOUBLE  3
+
+/* arms: left, up, right, down; dashes: 2, 3 or 4 */
+#define L(s)      (s)
+#define U(s)      ((s) << 2)
+#define R(s)      ((s) << 4)
+#define D(s)      ((s) << 6)
+#define DASH(n)   (((n) - 1) << 8)
+
+#define ARM_L(b)  ((b) & 3)
+#define ARM_U(b)  (((b) >> 2) & 3)
+#define ARM_R(b)  (((b) >> 4) & 3)
+#define ARM_D(b)  (((b) >> 6) & 3)
+#define DASHES(b) ((((b) >> 8) & 3) + 1)
+
+/* quadrants of the block elements */
+#define UL  1
+#define UR  2
+#define LL  4
+#define LR  8
+
+
+/* U+2500 - U+257F; 0: not drawn (the diagonals) */
+static const ushort boxdata [128] = {
+    /* 2500 */ L(LIGHT) | R(LIGHT),
+    /* 2501 */ L(HEAVY) | R(HEAVY),
+    /* 2502 */ U(LIGHT) | D(LIGHT),
+    /* 2503 */ U(HEAVY) | D(HEAVY),
+    /* 2504 */ L(LIGHT) | R(LIGHT) | DASH(3),
+    /* 2505 */ L(HEAVY) | R(HEAVY) | DASH(3),
+    /* 2506 */ U(LIGHT) | D(LIGHT) | DASH(3),
+    /* 2507 */ U(HEAVY) | D(HEAVY) | DASH(3),
+    /* 2508 */ L(LIGHT) | R(LIGHT) | DASH(4),
+    /* 2509 */ L(HEAVY) | R(HEAVY) | DASH(4),
+    /* 250A */ U(LIGHT) | D(LIGHT) | DASH(4),
+    /* 250B */ U(HEAVY) | D(HEAVY) | DASH(4),
+    /* 250C */ R(LIGHT) | D(LIGHT),
+    /* 250D */ R(HEAVY) | D(LIGHT),
+    /* 250E */ R(LIGHT) | D(HEAVY),
+    /* 250F */ R(HEAVY) | D(HEAVY),
+    /* 2510 */ L(LIGHT) | D(LIGHT),
+    /* 2511 */ L(HEAVY) | D(LIGHT),
+    /* 2512 */ L(LIGHT) | D(HEAVY),
+    /* 2513 */ L(HEAVY) | D(HEAVY),
+    /* 2514 */ U(LIGHT) | R(LIGHT),
+    /* 2515 */ U(LIGHT) | R(HEAVY),
+    /* 2516 */ U(HEAVY) | R(LIGHT),
+    /* 2517 */ U(HEAVY) | R(HEAVY),
+    /* 2518 */ U(LIGHT) | L(LIGHT),
+    /* 2519 */ U(LIGHT) | L(HEAVY),
+    /* 251A */ U(HEAVY) | L(LIGHT),
+    /* 251B */ U(HEAVY) | L(HEAVY),
+    /* 251C */ U(LIGHT) | D(LIGHT) | R(LIGHT),
+    /* 251D */ U(LIGHT) | D(LIGHT) | R(HEAVY),
+    /* 251E */ U(HEAVY) | D(LIGHT) | R(LIGHT),
+    /* 251F */ U(LIGHT) | D(HEAVY) | R(LIGHT),
+    /* 2520 */ U(HEAVY) | D(HEAVY) | R(LIGHT),
+    /* 2521 */ U(HEAVY) | D(LIGHT) | R(HEAVY),
+    /* 2522 */ U(LIGHT) | D(HEAVY) | R(HEAVY),
+    /* 2523 */ U(HEAVY) | D(HEAVY) | R(HEAVY),
+    /* 2524 */ U(LIGHT) | D(LIGHT) | L(LIGHT),
+    /* 2525 */ U(LIGHT) | D(LIGHT) | L(HEAVY),
+    /* 2526 */ U(HEAVY) | D(LIGHT) | L(LIGHT),
+    /* 2527 */ U(LIGHT) | D(HEAVY) | L(LIGHT),
+    /* 2528 */ U(HEAVY) | D(HEAVY) | L(LIGHT),
+    /* 2529 */ U(HEAVY) | D(LIGHT) | L(HEAVY),
+    /* 252A */ U(LIGHT) | D(HEAVY) | L(HEAVY),
+    /* 252B */ U(HEAVY) | D(HEAVY) | L(HEAVY),
+    /* 252C */ L(LIGHT) | R(LIGHT) | D(LIGHT),
+    /* 252D */ L(HEAVY) | R(LIGHT) | D(LIGHT),
+    /* 252E */ L(LIGHT) | R(HEAVY) | D(LIGHT),
+    /* 252F */ L(HEAVY) | R(HEAVY) | D(LIGHT),
+    /* 2530 */ L(LIGHT) | R(LIGHT) | D(HEAVY),
+    /* 2531 */ L(HEAVY) | R(LIGHT) | D(HEAVY),
+    /* 2532 */ L(LIGHT) | R(HEAVY) | D(HEAVY),
+    /* 2533 */ L(HEAVY) | R(HEAVY) | D(HEAVY),
+    /* 2534 */ L(LIGHT) | R(LIGHT) | U(LIGHT),
+    /* 2535 */ L(HEAVY) | R(LIGHT) | U(LIGHT),
+    /* 2536 */ L(LIGHT) | R(HEAVY) | U(LIGHT),
+    /* 2537 */ L(HEAVY) | R(HEAVY) | U(LIGHT),
+    /* 2538 */ L(LIGHT) | R(LIGHT) | U(HEAVY),
+    /* 2539 */ L(HEAVY) | R(LIGHT) | U(HEAVY),
+    /* 253A */ L(LIGHT) | R(HEAVY) | U(HEAVY),
+    /* 253B */ L(HEAVY) | R(HEAVY) | U(HEAVY),
+    /* 253C */ L(LIGHT) | R(LIGHT) | U(LIGHT) | D(LIGHT),
+    /* 253D */ L(HEAVY) | R(LIGHT) | U(LIGHT) | D(LIGHT),
+    /* 253E */ L(LIGHT) | R(HEAVY) | U(LIGHT) | D(LIGHT),
+    /* 253F */ L(HEAVY) | R(HEAVY) | U(LIGHT) | D(LIGHT),
+    /* 2540 */ L(LIGHT) | R(LIGHT) | U(HEAVY) | D(LIGHT),
+    /* 2541 */ L(LIGHT) | R(LIGHT) | U(LIGHT) | D(HEAVY),
+    /* 2542 */ L(LIGHT) | R(LIGHT) | U(HEAVY) | D(HEAVY),
+    /* 2543 */ L(HEAVY) | R(LIGHT) | U(HEAVY) | D(LIGHT),
+    /* 2544 */ L(LIGHT) | R(HEAVY) | U(HEAVY) | D(LIGHT),
+    /* 2545 */ L(HEAVY) | R(LIGHT) | U(LIGHT) | D(HEAVY),
+    /* 2546 */ L(LIGHT) | R(HEAVY) | U(LIGHT) | D(HEAVY),
+    /* 2547 */ L(HEAVY) | R(HEAVY) | U(HEAVY) | D(LIGHT),
+    /* 2548 */ L(HEAVY) | R(HEAVY) | U(LIGHT) | D(HEAVY),
+    /* 2549 */ L(HEAVY) | R(LIGHT) | U(HEAVY) | D(HEAVY),
+    /* 254A */ L(LIGHT) | R(HEAVY) | U(HEAVY) | D(HEAVY),
+    /* 254B */ L(HEAVY) | R(HEAVY) | U(HEAVY) | D(HEAVY),
+    /* 254C */ L(LIGHT) | R(LIGHT) | DASH(2),
+    /* 254D */ L(HEAVY) | R(HEAVY) | DASH(2),
+    /* 254E */ U(LIGHT) | D(LIGHT) | DASH(2),
+    /* 254F */ U(HEAVY) | D(HEAVY) | DASH(2),
+    /* 2550 */ L(DOUBLE) | R(DOUBLE),
+    /* 2551 */ U(DOUBLE) | D(DOUBLE),
+    /* 2552 */ R(DOUBLE) | D(LIGHT),
+    /* 2553 */ R(LIGHT) | D(DOUBLE),
+    /* 2554 */ R(DOUBLE) | D(DOUBLE),
+    /* 2555 */ L(DOUBLE) | D(LIGHT),
+    /* 2556 */ L(LIGHT) | D(DOUBLE),
+    /* 2557 */ L(DOUBLE) | D(DOUBLE),
+    /* 2558 */ U(LIGHT) | R(DOUBLE),
+    /* 2559 */ U(DOUBLE) | R(LIGHT),
+    /* 255A */ U(DOUBLE) | R(DOUBLE),
+    /* 255B */ U(LIGHT) | L(DOUBLE),
+    /* 255C */ U(DOUBLE) | L(LIGHT),
+    /* 255D */ U(DOUBLE) | L(DOUBLE),
+    /* 255E */ U(LIGHT) | D(LIGHT) | R(DOUBLE),
+    /* 255F */ U(DOUBLE) | D(DOUBLE) | R(LIGHT),
+    /* 2560 */ U(DOUBLE) | D(DOUBLE) | R(DOUBLE),
+    /* 2561 */ U(LIGHT) | D(LIGHT) | L(DOUBLE),
+    /* 2562 */ U(DOUBLE) | D(DOUBLE) | L(LIGHT),
+    /* 2563 */ U(DOUBLE) | D(DOUBLE) | L(DOUBLE),
+    /* 2564 */ L(DOUBLE) | R(DOUBLE) | D(LIGHT),
+    /* 2565 */ L(LIGHT) | R(LIGHT) | D(DOUBLE),
+    /* 2566 */ L(DOUBLE) | R(DOUBLE) | D(DOUBLE),
+    /* 2567 */ L(DOUBLE) | R(DOUBLE) | U(LIGHT),
+    /* 2568 */ L(LIGHT) | R(LIGHT) | U(DOUBLE),
+    /* 2569 */ L(DOUBLE) | R(DOUBLE) | U(DOUBLE),
+    /* 256A */ L(DOUBLE) | R(DOUBLE) | U(LIGHT) | D(LIGHT),
+    /* 256B */ L(LIGHT) | R(LIGHT) | U(DOUBLE) | D(DOUBLE),
+    /* 256C */ L(DOUBLE) | R(DOUBLE) | U(DOUBLE) | D(DOUBLE),
+    /* the rounded corners are drawn as the square ones */
+    /* 256D */ R(LIGHT) | D(LIGHT),
+    /* 256E */ L(LIGHT) | D(LIGHT),
+    /* 256F */ U(LIGHT) | L(LIGHT),
+    /* 2570 */ U(LIGHT) | R(LIGHT),
+    /* 2571 */ 0,
+    /* 2572 */ 0,
+    /* 2573 */ 0,
+    /* 2574 */ L(LIGHT),
+    /* 2575 */ U(LIGHT),
+    /* 2576 */ R(LIGHT),
+    /* 2577 */ D(LIGHT),
+    /* 2578 */ L(HEAVY),
+    /* 2579 */ U(HEAVY),
+    /* 257A */ R(HEAVY),
+    /* 257B */ D(HEAVY),
+    /* 257C */ L(LIGHT) | R(HEAVY),
+    /* 257D */ U(LIGHT) | D(HEAVY),
+    /* 257E */ L(HEAVY) | R(LIGHT),
+    /* 257F */ U(HEAVY) | D(LIGHT)
+};
+
+/* U+2590 - U+259F: the quadrants (the halves, eighths and shades are
+ * handled in boxdraw_block) */
+static const byte quaddata [16] = {
+    0, 0, 0, 0, 0, 0,                   /* 2590 - 2595 */
+    LL, LR, UL, UL | LL | LR,           /* 2596 - 2599 */
+    UL | LR, UL | UR | LL, UL | UR | LR, /* 259A - 259C */
+    UR, UR | LL, UR | LL | LR           /* 259D - 259F */
+};
+
+
+static uint boxdraw_rect (XRectangle *r, int x1, int y1, int x2, int y2);
+static uint boxdraw_lines (ushort data, int w, int h, XRectangle *rects);
+static uint boxdraw_dashes (ushort data, int w, int h, XRectangle *rects);
+static uint boxdraw_block (Rune rune, int w, int h, XRectangle *rects);
+static uint boxdraw_shade (int level, int w, int h, XRectangle *rects);
+
+
+int
+boxdraw_is (Rune rune)
+{
+    if ( BETWEEN (rune, 0x2500, 0x257f) )
+        return boxdata [rune - 0x2500] != 0;
+
+    return BETWEEN (rune, 0x2580, 0x259f) ||
+           BETWEEN (rune, 0x23ba, 0x23bd);
+}
+
+uint
+boxdraw_rect (XRectangle *r, int x1, int y1, int x2, int y2)
+{
+    if ( x2 <= x1 || y2 <= y1 )
+        return 0;
+
+    r->x = x1;
+    r->y = y1;
+    r->width = x2 - x1;
+    r->height = y2 - y1;
+    return 1;
+}
+
+/*
+ * Each arm is a line from the cell edge to the centre, shifted past the
+ * centre to join the perpendicular arms.  The two lines of a double arm
+ * end where they meet the lines of the perpendicular arms, which leaves
+ * the gaps of the double junctions open.
+ */
+uint
+boxdraw_lines (ushort data, int w, int h, XRectangle *rects)
+{
+    /* thickness and offset of the light, heavy and double lines */
+    int lw, hw, xl, xh, yl, yh;
+    int l, u, r, d, sl, su, sr, sd;
+    int x1, x2, y1, y2, vmin, vmax, hmin, hmax;
+    uint n;
+
+    lw = MAX (1, (MIN (w, h) + 4) / 8);
+    hw = lw << 1;
+    xl = (w - lw) / 2;
+    xh = (w - hw) / 2;
+    yl = (h - lw) / 2;
+    yh = (h - hw) / 2;
+
+    l = ARM_L (data);
+    u = ARM_U (data);
+    r = ARM_R (data);
+    d = ARM_D (data);
+
+    /* single (light or heavy) arms */
+    sl = l == LIGHT || l == HEAVY;
+    su = u == LIGHT || u == HEAVY;
+    sr = r == LIGHT || r == HEAVY;
+    sd = d == LIGHT || d == HEAVY;
+
+    /* extent of the vertical arms in x, of the horizontal ones in y */
+    if ( u == DOUBLE || d == DOUBLE ) {
+        vmin = xl - lw;
+        vmax = xl + (lw << 1);
+    } else if ( u == HEAVY || d == HEAVY ) {
+        vmin = xh;
+        vmax = xh + hw;
+    } else {
+        vmin = xl;
+        vmax = xl + lw;
+    }
+    if ( l == DOUBLE || r == DOUBLE ) {
+        hmin = yl - lw;
+        hmax = yl + (lw << 1);
+    } else if ( l == HEAVY || r == HEAVY ) {
+        hmin = yh;
+        hmax = yh + hw;
+    } else {
+        hmin = yl;
+        hmax = yl + lw;
+    }
+
+    n = 0;
+
+    /* single horizontal arms end over the verticals or at the near line
+     * of a double vertical passing by */
+    if ( u == NONE && d == NONE ) {
+        x1 = xl;
+        x2 = xl + lw;
+    } else if ( u == DOUBLE && d == DOUBLE ) {
+        x1 = xl + lw;
+        x2 = xl;
+    } else {
+        x1 = vmin;
+        x2 = vmax;
+    }
+    if ( sl ) {
+        y1 = l == HEAVY ? yh : yl;
+        n += boxdraw_rect (rects + n, 0, y1, sr ? w : x2,
+                y1 + (l == HEAVY ? hw : lw));
+    }
+    if ( sr ) {
+        y1 = r == HEAVY ? yh : yl;
+        n += boxdraw_rect (rects + n, sl ? 0 : x1, y1, w,
+                y1 + (r == HEAVY ? hw : lw));
+    }
+
+    /* single vertical arms */
+    if ( l == NONE && r == NONE ) {
+        y1 = yl;
+        y2 = yl + lw;
+    } else if ( l == DOUBLE && r == DOUBLE ) {
+        y1 = yl + lw;
+        y2 = yl;
+    } else {
+        y1 = hmin;
+        y2 = hmax;
+    }
+    if ( su ) {
+        x1 = u == HEAVY ? xh : xl;
+        n += boxdraw_rect (rects + n, x1, 0, x1 + (u == HEAVY ? hw : lw),
+                sd ? h : y2);
+    }
+    if ( sd ) {
+        x1 = d == HEAVY ? xh : xl;
+        n += boxdraw_rect (rects + n, x1, su ? 0 : y1,
+                x1 + (d == HEAVY ? hw : lw), h);
+    }
+
+    /* double horizontal arms: the upper and the lower line */
+    y1 = yl - lw;
+    y2 = yl + lw;
+    if ( l == DOUBLE ) {
+        x1 = u != NONE ? vmin : r != NONE ? xl : d != NONE ? vmax : xl;
+        x2 = d != NONE ? vmin : r != NONE ? xl : u != NONE ? vmax : xl;
+        n += boxdraw_rect (rects + n, 0, y1, x1, y1 + lw);
+        n += boxdraw_rect (rects + n, 0, y2, x2, y2 + lw);
+    }
+    if ( r == DOUBLE ) {
+        x1 = u != NONE ? vmax : l != NONE ? xl : d != NONE ? vmin : xl;
+        x2 = d != NONE ? vmax : l != NONE ? xl : u != NONE ? vmin : xl;
+        n += boxdraw_rect (rects + n, x1, y1, w, y1 + lw);
+        n += boxdraw_rect (rects + n, x2, y2, w, y2 + lw);
+    }
+
+    /* double vertical arms: the left and the right line; they cover the
+     * corners the horizontal lines leave */
+    x1 = xl - lw;
+    x2 = xl + lw;
+    if ( u == DOUBLE ) {
+        y1 = l != NONE ? hmin + lw : d != NONE ? yl : r != NONE ? hmax : yl;
+        y2 = r != NONE ? hmin + lw : d != NONE ? yl : l != NONE ? hmax : yl;
+        n += boxdraw_rect (rects + n, x1, 0, x1 + lw, y1);
+        n += boxdraw_rect (rects + n, x2, 0, x2 + lw, y2);
+    }
+    if ( d == DOUBLE ) {
+        y1 = l != NONE ? hmax - lw : u != NONE ? yl : r != NONE ? hmin : yl;
+        y2 = r != NONE ? hmax - lw : u != NONE ? yl : l != NONE ? hmin : yl;
+        n += boxdraw_rect (rects + n, x1, y1, x1 + lw, h);
+        n += boxdraw_rect (rects + n, x2, y2, x2 + lw, h);
+    }
+
+    return n;
+}
+
+uint
+boxdraw_dashes (ushort data, int w, int h, XRectangle *rects)
+{
+    int lw, t, i, dashes, gap, pos, x, y;
+    uint n;
+
+    lw = MAX (1, (MIN (w, h) + 4) / 8);
+    dashes = DASHES (data);
+    n = 0;
+
+    if ( ARM_L (data) != NONE ) {
+        /* horizontal */
+        t = ARM_L (data) == HEAVY ? lw << 1 : lw;
+        y = (h - t) / 2;
+        gap = MAX (1, w / dashes / 3);
+        for ( i = 0; i < dashes; i++ ) {
+            pos = i * w / dashes;
+            x = (i + 1) * w / dashes - gap;
+            n += boxdraw_rect (rects + n, pos, y, x, y + t);
+        }
+    } else {
+        /* vertical */
+        t = ARM_U (data) == HEAVY ? lw << 1 : lw;
+        x = (w - t) / 2;
+        gap = MAX (1, h / dashes / 3);
+        for ( i = 0; i < dashes; i++ ) {
+            pos = i * h / dashes;
+            y = (i + 1) * h / dashes - gap;
+            n += boxdraw_rect (rects + n, x, pos, x + t, y);
+        }
+    }
+    return n;
+}
+
+uint
+boxdraw_shade (int level, int w, int h, XRectangle *rects)
+{
+    int x, y;
+    uint n;
+
+    /* 1: 25%, 2: 50%, 3: 75% of the pixels */
+    for ( n = 0, y = 0; y < h; y++ ) {
+        for ( x = 0; x < w; x++ ) {
+            if ( level == 1 ? (x & 1) == 0 && (y & 1) == 0 :
+                 level == 2 ? ((x + y) & 1) == 0 :
+                              (x & 1) == 0 || (y & 1) == 0 )
+                n += boxdraw_rect (rects + n, x, y, x + 1, y + 1);
+        }
+    }
+    return n;
+}
+
+uint
+boxdraw_block (Rune rune, int w, int h, XRectangle *rects)
+{
+    int q, w2, h2;
+    uint n;
+
+    /* lower eighths, full block */
+    if ( BETWEEN (rune, 0x2581, 0x2588) )
+        return boxdraw_rect (rects, 0, h - h * (rune - 0x2580) / 8, w, h);
+
+    /* left eighths */
+    if ( BETWEEN (rune, 0x2589, 0x258f) )
+        return boxdraw_rect (rects, 0, 0, w * (0x2590 - rune) / 8, h);
+
+    switch ( rune ) {
+        case 0x2580:  /* upper half */
+            return boxdraw_rect (rects, 0, 0, w, h / 2);
+        case 0x2590:  /* right half */
+            return boxdraw_rect (rects, w / 2, 0, w, h);
+        case 0x2591:
+        case 0x2592:
+        case 0x2593:
+            return boxdraw_shade (rune - 0x2590, w, h, rects);
+        case 0x2594:  /* upper eighth */
+            return boxdraw_rect (rects, 0, 0, w, DIVCEIL (h, 8));
+        case 0x2595:  /* right eighth */
+            return boxdraw_rect (rects, w - DIVCEIL (w, 8), 0, w, h);
+    }
+
+    /* quadrants */
+    q = quaddata [rune - 0x2590];
+    w2 = w / 2;
+    h2 = h / 2;
+    n = 0;
+    if ( q & UL )
+        n += boxdraw_rect (rects + n, 0, 0, w2, h2);
+    if ( q & UR )
+        n += boxdraw_rect (rects + n, w2, 0, w, h2);
+    if ( q & LL )
+        n += boxdraw_rect (rects + n, 0, h2, w2, h);
+    if ( q & LR )
+        n += boxdraw_rect (rects + n, w2, h2, w, h);
+
+    return n;
+}
+
+uint
+boxdraw_rects (Rune rune, int w, int h, XRectangle *rects)
+{
+    ushort data;
+    int lw, y;
+
+    /* DEC scan lines 1, 3, 7 and 9 */
+    if ( BETWEEN (rune, 0x23ba, 0x23bd) ) {
+        lw = MAX (1, (MIN (w, h) + 4) / 8);
+        y = (h - lw) * ((rune - 0x23ba) * 2 + (rune > 0x23bb ? 2 : 0)) / 8;
+        return boxdraw_rect (rects, 0, y, w, y + lw);
+    }
+    if ( BETWEEN (rune, 0x2580, 0x259f) )
+        return boxdraw_block (rune, w, h, rects);
+
+    if ( !BETWEEN (rune, 0x2500, 0x257f) )
+        return 0;
+
+    data = boxdata [rune - 0x2500];
+    if ( data == 0 )
+        return 0;
+
+    if ( DASHES (data) > 1 )
+        return boxdraw_dashes (data, w, h, rects);
+
+    return boxdraw_lines (data, w, h, rects);
+}
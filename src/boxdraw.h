@@ -0,0 +1,24 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _BOXDRAW_H_
+#define _BOXDRAW_H_
+
+#include <X11/Xlib.h>
+#include "st.h"
+
+
+/* rectangles boxdraw_rects may return for a $w x $h cell */
+#define BOXDRAW_MAX(w, h)  ((w) * (h) + 16)
+
+
+/*
+ * Box drawing (U+2500 - U+257F), block elements (U+2580 - U+259F) and the
+ * DEC scan lines (U+23BA - U+23BD) are drawn with rectangles at the cell
+ * size instead of the font: the lines join the neighbouring cells.
+ */
+
+int boxdraw_is (Rune rune);
+uint boxdraw_rects (Rune rune, int w, int h, XRectangle *rects);
+
+
+#endif  /* _BOXDRAW_H_ */
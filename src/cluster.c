@@ -0,0 +1,170 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cluster.h"
+#include "thunk.h"
+
+
+typedef struct {
+    Rune marks [CLUSTER_MARKS];
+    uint n;             /* 0: free entry */
+} Cluster;
+
+typedef struct {
+    ushort slots [CLUSTER_MAX * 2];  /* index of the entry; 0: empty slot */
+    Thunk entries;      /* Cluster; the entry 0 is never used */
+    Thunk free;         /* ushort: entries freed by the sweep */
+    ulong interned;
+    ulong swept;
+} ClusterTable;
+
+
+static uint cluster_hash (const Rune *marks, uint n);
+static ushort * cluster_probe (const Rune *marks, uint n);
+
+
+static ClusterTable ctab = { 0 };
+
+
+uint
+cluster_hash (const Rune *marks, uint n)
+{
+    uint h;
+
+    /* FNV-1a */
+    for ( h = 2166136261u; n != 0; n--, marks++ )
+        h = (h ^ *marks) * 16777619u;
+    return h;
+}
+
+/* linear probing; the slots are never more than half full */
+ushort *
+cluster_probe (const Rune *marks, uint n)
+{
+    ushort *slot;
+    Cluster *c;
+    uint i;
+
+    for ( i = cluster_hash (marks, n);; i++ ) {
+        slot = ctab.slots + (i & (LEN (ctab.slots) - 1));
+        if ( *slot == 0 )
+            return slot;
+
+        c = (Cluster *) ctab.entries.items + *slot;
+        if ( c->n == n && memcmp (c->marks, marks, n * sizeof (Rune)) == 0 )
+            return slot;
+    }
+}
+
+/* the marks beyond CLUSTER_MARKS are dropped; 0: the entries are used up */
+ushort
+cluster_intern (const Rune *marks, uint n)
+{
+    ushort *slot, idx;
+    Cluster *c;
+
+    if ( n == 0 )
+        return 0;
+    if ( n > CLUSTER_MARKS )
+        n = CLUSTER_MARKS;
+
+    if ( ctab.entries.items == NULL ) {
+        thunk_create (&ctab.entries, 0, sizeof (Cluster));
+        thunk_create (&ctab.free, 0, sizeof (ushort));
+        ((Cluster *) thunk_alloc_next (&ctab.entries))->n = 0;
+    }
+
+    slot = cluster_probe (marks, n);
+    if ( *slot != 0 )
+        return *slot;
+
+    /* a freed entry or a new one */
+    if ( ctab.free.nelements != 0 )
+        idx = ((ushort *) ctab.free.items) [--ctab.free.nelements];
+    else if ( ctab.entries.nelements < CLUSTER_MAX ) {
+        idx = ctab.entries.nelements;
+        thunk_alloc_next (&ctab.entries);
+    } else
+        return 0;
+
+    c = (Cluster *) ctab.entries.items + idx;
+    memcpy (c->marks, marks, n * sizeof (Rune));
+    c->n = n;
+
+    *slot = idx;
+    ctab.interned++;
+    return idx;
+}
+
+const Rune *
+cluster_get (ushort idx, uint *n)
+{
+    Cluster *c;
+
+    c = (Cluster *) ctab.entries.items + idx;
+    *n = c->n;
+    return c->marks;
+}
+
+uint
+cluster_len (ushort idx)
+{
+    return ((Cluster *) ctab.entries.items) [idx].n;
+}
+
+/* entries allocated so far: the size of the map cluster_sweep takes */
+uint
+cluster_count (void)
+{
+    return ctab.entries.nelements;
+}
+
+/*
+ * The entries not set in $used (indexed like the cells) are freed and the
+ * others rehashed.  Returns the number of free entries.
+ */
+uint
+cluster_sweep (const byte *used)
+{
+    ushort *slot;
+    Cluster *c;
+    uint i;
+
+    memset (ctab.slots, 0, sizeof (ctab.slots));
+    ctab.free.nelements = 0;
+
+    for ( i = 1, c = (Cluster *) ctab.entries.items + 1;
+          i < ctab.entries.nelements;
+          i++, c++ ) {
+        if ( used [i] ) {
+            slot = cluster_probe (c->marks, c->n);
+            *slot = i;
+            continue;
+        }
+
+        c->n = 0;
+        *(ushort *) thunk_alloc_next (&ctab.free) = i;
+    }
+    ctab.swept++;
+    return ctab.free.nelements;
+}
+
+void
+cluster_stats (ulong *interned, ulong *swept)
+{
+    *interned = ctab.interned;
+    *swept = ctab.swept;
+}
+
+void
+cluster_free (void)
+{
+    if ( ctab.entries.items == NULL )
+        return;
+
+    thunk_free (&ctab.entries);
+    thunk_free (&ctab.free);
+    ctab.entries.items = NULL;
+}
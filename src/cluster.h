@@ -0,0 +1,24 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _CLUSTER_H_
+#define _CLUSTER_H_
+
+#include "st.h"
+
+
+/*
+ * Grapheme clusters: a cell keeps its base rune and the index of the
+ * combining marks that follow it (0: none).  The mark sequences are
+ * interned: the cells with the same marks share an entry.
+ */
+
+ushort cluster_intern (const Rune *marks, uint n);
+const Rune * cluster_get (ushort idx, uint *n);
+uint cluster_len (ushort idx);
+uint cluster_count (void);
+uint cluster_sweep (const byte *used);
+void cluster_stats (ulong *interned, ulong *swept);
+void cluster_free (void);
+
+
+#endif  /* _CLUSTER_H_ */
@@ -14,6 +14,32 @@
 /* font: see http://freedesktop.org/software/fontconfig/fontconfig-user.html */
 #define FONT  "Nimbus Mono L:pixelsize=16:antialias=true:autohint=true"
 
+/* glyph memory of one fallback font and the budget of all of them (bytes);
+ * over the budget the least recently used fallback fonts are closed */
+#define FALLBACK_FACE_MEMORY  (512 * 1024)
+#define FALLBACK_MEMORY       (16 * 1024 * 1024)
+
+/* fonts of the previous zoom sizes kept open to zoom back instantly; the
+ * budget (bytes) is estimated from the glyph memory of their fonts and 0
+ * disables it */
+#define FONTSET_MEMORY  (32 * 1024 * 1024)
+
+/* true colours (and faint ones) kept in the colour cache after the palette,
+ * a power of 2; when they are used up the ones no cell refers to are freed
+ * and the nearest xterm colour is taken if that isn't enough */
+#define TRUECOLOR_MAX  4096
+
+/* combining mark sequences kept for the grapheme clusters of the cells
+ * (a power of 2, at most 65536) and the marks of one cluster; when they
+ * are used up the ones no cell refers to are freed, otherwise the marks
+ * are dropped */
+#define CLUSTER_MAX    4096
+#define CLUSTER_MARKS  6
+
+/* runs shaped by HarfBuzz (built with --harfbuzz) kept for the redraws, a
+ * power of 2 */
+#define SHAPE_CACHE  1024
+
 /* What program is execed by st depends of these precedence rules:
  * 1: program passed with --
  * 2: scroll and/or utmp (see bellow)
@@ -56,6 +82,10 @@
 #define LATENCY_MIN  8
 #define LATENCY_MAX  33
 
+/* glyphs rasterized and uploaded per idle pass of the main loop after the
+ * fonts are loaded (printable ASCII and box drawing), 0 disables it */
+#define PREWARM_SLICE  16
+
 /*
  * Synchronized-Update timeout in ms
  * http://gitlab.com.peihua.vpn358.com:8082/gnachman/iterm2/-/wikis/synchronized-updates-spec
@@ -0,0 +1,297 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "fccache.h"
+#include "strutil.h"
+#include "thunk.h"
+
+
+#define FCCACHE_NAME     "st-fallback"
+#define FCCACHE_VERSION  2
+
+
+/* runes first..last of the pattern resolve to the face file:index */
+typedef struct {
+    uint key;
+    Rune first;
+    Rune last;
+    int index;
+    char *file;
+} DiskRange;
+
+typedef struct {
+    Thunk ranges;
+    char *path;
+    ulong stamp;
+    int loaded;
+    int dirty;
+} DiskCache;
+
+
+static char * fccache_path (void);
+static void fccache_mkdir (const char *path);
+static ulong fccache_stamp (void);
+static ulong fccache_stamp_list (FcStrList *list, ulong stamp);
+static void fccache_load (void);
+
+
+static DiskCache fcdisk = { 0 };
+
+
+char *
+fccache_path (void)
+{
+    const char *dir, *home;
+    char *path;
+
+    dir = getenv ("XDG_CACHE_HOME");
+    if ( dir != NULL && *dir != '\0' ) {
+        path = x_malloc (strlen (dir) + sizeof (FCCACHE_NAME) + 1);
+        sprintf (path, "%s/%s", dir, FCCACHE_NAME);
+        return path;
+    }
+    home = getenv ("HOME");
+    if ( home == NULL || *home == '\0' )
+        return NULL;
+
+    path = x_malloc (strlen (home) + sizeof ("/.cache/" FCCACHE_NAME));
+    sprintf (path, "%s/.cache/%s", home, FCCACHE_NAME);
+    return path;
+}
+
+/* the directories of $path are created as mkdir -p does */
+void
+fccache_mkdir (const char *path)
+{
+    char *dir, *p;
+
+    dir = s_dup (path);
+    for ( p = dir + 1; (p = strchr (p, '/')) != NULL; p++ ) {
+        *p = '\0';
+        mkdir (dir, 0700);
+        *p = '/';
+    }
+    free (dir);
+}
+
+ulong
+fccache_stamp_list (FcStrList *list, ulong stamp)
+{
+    struct stat st;
+    FcChar8 *name;
+
+    if ( list == NULL )
+        return stamp;
+
+    while ( (name = FcStrListNext (list)) != NULL ) {
+        if ( stat ((char *) name, &st) == 0 && (ulong) st.st_mtime > stamp )
+            stamp = st.st_mtime;
+    }
+    FcStrListDone (list);
+    return stamp;
+}
+
+ulong
+fccache_stamp (void)
+{
+    ulong stamp;
+
+    /* the newest configuration file or font directory; adding or removing
+     * a font changes the mtime of its directory */
+    stamp = fccache_stamp_list (FcConfigGetConfigFiles (NULL), 0);
+    stamp = fccache_stamp_list (FcConfigGetFontDirs (NULL), stamp);
+    return stamp;
+}
+
+void
+fccache_load (void)
+{
+    char file [4096];
+    DiskRange *r;
+    FILE *f;
+    ulong stamp;
+    uint key;
+    Rune first, last;
+    int version, fcversion, index;
+
+    fcdisk.loaded = FcTrue;
+    thunk_create (&fcdisk.ranges, 0, sizeof (DiskRange));
+
+    fcdisk.path = fccache_path ();
+    fcdisk.stamp = fccache_stamp ();
+    if ( fcdisk.path == NULL )
+        return;
+
+    f = fopen (fcdisk.path, "r");
+    if ( f == NULL )
+        return;
+
+    /* header: a different fontconfig setup drops the whole file */
+    if ( fscanf (f, FCCACHE_NAME " %d %d %lu\n", &version, &fcversion, &stamp) != 3 ||
+         version != FCCACHE_VERSION || fcversion != FcGetVersion () ||
+         stamp != fcdisk.stamp ) {
+        fcdisk.dirty = FcTrue;
+        goto quit;
+    }
+    while ( fscanf (f, "%x %x %x %d %4095[^\n]\n",
+                &key, &first, &last, &index, file) == 5 ) {
+        r = (DiskRange *) thunk_alloc_next (&fcdisk.ranges);
+        r->key = key;
+        r->first = first;
+        r->last = last;
+        r->index = index;
+        r->file = s_dup (file);
+    }
+
+quit:
+    fclose (f);
+}
+
+/* the fonts resolved for a rune don't depend on the size: one key for
+ * every zoom step */
+uint
+fccache_key (FcPattern *pattern)
+{
+    FcPattern *p;
+    FcChar8 *name, *s;
+    uint key;
+
+    p = FcPatternDuplicate (pattern);
+    if ( p == NULL )
+        return 0;
+    FcPatternDel (p, FC_PIXEL_SIZE);
+    FcPatternDel (p, FC_SIZE);
+
+    name = FcNameUnparse (p);
+    FcPatternDestroy (p);
+    if ( name == NULL )
+        return 0;
+
+    /* FNV-1a */
+    for ( key = 2166136261u, s = name; *s != '\0'; s++ )
+        key = (key ^ *s) * 16777619u;
+
+    free (name);
+    return key;
+}
+
+int
+fccache_find (uint key, Rune rune, const char **file, int *index)
+{
+    DiskRange *r;
+    uint i;
+
+    if ( !fcdisk.loaded )
+        fccache_load ();
+
+    for ( i = fcdisk.ranges.nelements, r = (DiskRange *) fcdisk.ranges.items;
+          i != 0;
+          i--, r++ ) {
+        if ( r->key == key && BETWEEN (rune, r->first, r->last) ) {
+            *file = r->file;
+            *index = r->index;
+            return FcTrue;
+        }
+    }
+    return FcFalse;
+}
+
+void
+fccache_add (uint key, Rune rune, const char *file, int index)
+{
+    DiskRange *r;
+    uint i;
+
+    if ( !fcdisk.loaded )
+        fccache_load ();
+
+    fcdisk.dirty = FcTrue;
+
+    /* grow a neighbouring range of the same face */
+    for ( i = fcdisk.ranges.nelements, r = (DiskRange *) fcdisk.ranges.items;
+          i != 0;
+          i--, r++ ) {
+        if ( r->key != key || r->index != index ||
+             strcmp (r->file, file) != 0 )
+            continue;
+
+        if ( r->last + 1 == rune ) {
+            r->last = rune;
+            return;
+        }
+        if ( r->first == rune + 1 ) {
+            r->first = rune;
+            return;
+        }
+    }
+
+    r = (DiskRange *) thunk_alloc_next (&fcdisk.ranges);
+    r->key = key;
+    r->first = rune;
+    r->last = rune;
+    r->index = index;
+    r->file = s_dup (file);
+}
+
+void
+fccache_save (void)
+{
+    char *tmp;
+    DiskRange *r;
+    FILE *f;
+    uint i;
+
+    if ( !fcdisk.dirty || fcdisk.path == NULL )
+        return;
+
+    /* write a private file and move it over: another st may read it */
+    tmp = x_malloc (strlen (fcdisk.path) + 16);
+    sprintf (tmp, "%s.%d", fcdisk.path, (int) getpid ());
+    fccache_mkdir (tmp);
+
+    f = fopen (tmp, "w");
+    if ( f == NULL )
+        goto quit;
+
+    fprintf (f, FCCACHE_NAME " %d %d %lu\n", FCCACHE_VERSION,
+            FcGetVersion (), fcdisk.stamp);
+
+    for ( i = fcdisk.ranges.nelements, r = (DiskRange *) fcdisk.ranges.items;
+          i != 0;
+          i--, r++ )
+        fprintf (f, "%x %x %x %d %s\n", r->key, r->first, r->last,
+                r->index, r->file);
+
+    if ( fclose (f) == 0 && rename (tmp, fcdisk.path) == 0 )
+        fcdisk.dirty = FcFalse;
+    else
+        unlink (tmp);
+
+quit:
+    free (tmp);
+}
+
+void
+fccache_free (void)
+{
+    DiskRange *r;
+    uint i;
+
+    if ( !fcdisk.loaded )
+        return;
+
+    for ( i = fcdisk.ranges.nelements, r = (DiskRange *) fcdisk.ranges.items;
+          i != 0;
+          i--, r++ )
+        free (r->file);
+
+    thunk_free (&fcdisk.ranges);
+    free (fcdisk.path);
+    fcdisk.loaded = FcFalse;
+}
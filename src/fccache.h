@@ -0,0 +1,23 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FCCACHE_H_
+#define _FCCACHE_H_
+
+#include <fontconfig/fontconfig.h>
+#include "st.h"
+
+
+/*
+ * On-disk cache of the fallback fonts fontconfig resolved for a rune, so
+ * another st doesn't sort and match the fonts again.  The file is dropped
+ * when the fontconfig configuration or a font directory changes.
+ */
+
+uint fccache_key (FcPattern *pattern);
+int fccache_find (uint key, Rune rune, const char **file, int *index);
+void fccache_add (uint key, Rune rune, const char *file, int index);
+void fccache_save (void);
+void fccache_free (void);
+
+
+#endif  /* _FCCACHE_H_ */
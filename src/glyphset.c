@@ -0,0 +1,247 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifdef FEATURE_GLYPHSET
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <X11/extensions/Xrender.h>
+
+#include "glyphset.h"
+#include "raster.h"
+#include "st.h"
+#include "thunk.h"
+
+
+typedef struct {
+    XftFont *font;
+    GlyphSet set;       /* None: drawn by Xft */
+    RasterMode mode;
+    int advance;        /* xOff of the glyphs: the cell width */
+    uint nglyphs;
+    byte *loaded;       /* bit per uploaded glyph */
+} GlyphFace;
+
+typedef struct {
+    Thunk faces;        /* GlyphFace */
+    Thunk elts;         /* XGlyphElt32 */
+    Thunk chars;        /* unsigned int */
+    Thunk image;        /* byte: bitmap of the uploaded glyph */
+    XRenderPictFormat *format;
+} GlyphSets;
+
+
+static GlyphFace *glyphset_face (Display *, XftFont *, int);
+static void glyphset_face_init (Display *, GlyphFace *, XftFont *, int);
+static int glyphset_upload (Display *, GlyphFace *, FT_UInt);
+
+
+static GlyphSets gs;
+
+
+void
+glyphset_face_init (Display *dpy, GlyphFace *gf, XftFont *font, int cw)
+{
+    FT_Face face;
+
+    gf->font = font;
+    gf->advance = cw;
+    gf->set = None;
+    gf->loaded = NULL;
+
+    if ( gs.format == NULL ) {
+        gs.format = XRenderFindStandardFormat (dpy, PictStandardA8);
+        if ( gs.format == NULL )
+            return;
+    }
+    raster_mode (font, &gf->mode);
+    /* the glyph sets hold coverage masks: Xft draws the colour glyphs */
+    gf->mode.color = FcFalse;
+
+    face = XftLockFace (font);
+    if ( face == NULL )
+        return;
+
+    /* bitmap-only faces are colour emoji mostly */
+    if ( FT_IS_SCALABLE (face) ) {
+        gf->nglyphs = face->num_glyphs;
+        gf->loaded = x_malloc ((gf->nglyphs + 7) >> 3);
+        memset (gf->loaded, 0, (gf->nglyphs + 7) >> 3);
+        gf->set = XRenderCreateGlyphSet (dpy, gs.format);
+    }
+    XftUnlockFace (font);
+}
+
+GlyphFace *
+glyphset_face (Display *dpy, XftFont *font, int cw)
+{
+    GlyphFace *gf, *end;
+
+    if ( gs.faces.items == NULL )
+        thunk_create (&gs.faces, 16, sizeof (GlyphFace));
+
+    for ( gf = (GlyphFace *) gs.faces.items, end = gf + gs.faces.nelements;
+          gf != end;
+          gf++ ) {
+        if ( gf->font == font )
+            return gf;
+    }
+
+    gf = (GlyphFace *) thunk_alloc_next (&gs.faces);
+    glyphset_face_init (dpy, gf, font, cw);
+    return gf;
+}
+
+int
+glyphset_upload (Display *dpy, GlyphFace *gf, FT_UInt glyph)
+{
+    RasterGlyph rg;
+    XGlyphInfo info;
+    Glyph id;
+
+    if ( glyph >= gf->nglyphs ||
+         !raster_glyph (gf->font, &gf->mode, glyph, &gs.image, &rg) )
+        return False;
+
+    /* the pen moves a cell: the glyphs of a row share an element */
+    info.width = rg.width;
+    info.height = rg.height;
+    info.x = -rg.left;
+    info.y = rg.top;
+    info.xOff = gf->advance;
+    info.yOff = 0;
+
+    id = glyph;
+    XRenderAddGlyphs (dpy, gf->set, &id, &info, 1, (char *) gs.image.items,
+            rg.stride * rg.height);
+    gf->loaded [glyph >> 3] |= 1 << (glyph & 7);
+    return True;
+}
+
+void
+glyphset_draw (XftDraw *draw, const XftColor *color,
+        const XftGlyphFontSpec *specs, int len, int cw)
+{
+    Display *dpy = XftDrawDisplay (draw);
+    Picture dst = XftDrawPicture (draw), src;
+    XGlyphElt32 *elt = NULL;
+    GlyphFace *gf = NULL;
+    XftFont *font = NULL;
+    unsigned int *chars;
+    int penx = 0, peny = 0;
+    uint i;
+
+    if ( dst == None ) {
+        XftDrawGlyphFontSpec (draw, color, specs, len);
+        return;
+    }
+    if ( gs.elts.items == NULL ) {
+        thunk_create (&gs.elts, 256, sizeof (XGlyphElt32));
+        thunk_create (&gs.chars, 256, sizeof (unsigned int));
+        thunk_create (&gs.image, 1024, sizeof (byte));
+    }
+    gs.elts.nelements = 0;
+    gs.chars.nelements = 0;
+
+    for ( ; len != 0; len--, specs++ ) {
+        if ( specs->font != font ) {
+            font = specs->font;
+            gf = glyphset_face (dpy, font, cw);
+        }
+        if ( gf->set == None ||
+             (!(gf->loaded [specs->glyph >> 3] & (1 << (specs->glyph & 7))) &&
+              !glyphset_upload (dpy, gf, specs->glyph)) ) {
+            XftDrawGlyphFontSpec (draw, color, specs, 1);
+            continue;
+        }
+
+        chars = (unsigned int *) thunk_alloc_next (&gs.chars);
+        *chars = specs->glyph;
+
+        /* a glyph at the pen joins the element; otherwise a new element's
+         * offset moves the pen to it */
+        if ( elt == NULL || elt->glyphset != gf->set ||
+             specs->x != penx || specs->y != peny ) {
+            elt = (XGlyphElt32 *) thunk_alloc_next (&gs.elts);
+            elt->glyphset = gf->set;
+            elt->nchars = 0;
+            elt->xOff = specs->x - penx;
+            elt->yOff = specs->y - peny;
+        }
+        elt->nchars++;
+        penx = specs->x + gf->advance;
+        peny = specs->y;
+    }
+    if ( gs.elts.nelements == 0 )
+        return;
+
+    /* the chars may have moved while growing */
+    chars = (unsigned int *) gs.chars.items;
+    for ( i = 0, elt = (XGlyphElt32 *) gs.elts.items;
+          i < gs.elts.nelements;
+          chars += elt->nchars, i++, elt++ )
+        elt->chars = chars;
+
+    src = XRenderCreateSolidFill (dpy, &color->color);
+    XRenderCompositeText32 (dpy, PictOpOver, src, dst, gs.format, 0, 0, 0, 0,
+            (XGlyphElt32 *) gs.elts.items, gs.elts.nelements);
+    XRenderFreePicture (dpy, src);
+}
+
+void
+glyphset_prewarm (Display *dpy, XftFont *font, FT_UInt glyph, int cw)
+{
+    GlyphFace *gf;
+
+    gf = glyphset_face (dpy, font, cw);
+    if ( gf->set != None && !(gf->loaded [glyph >> 3] & (1 << (glyph & 7))) )
+        glyphset_upload (dpy, gf, glyph);
+}
+
+void
+glyphset_forget (Display *dpy, XftFont *font)
+{
+    GlyphFace *gf, *end;
+
+    if ( gs.faces.items == NULL )
+        return;
+
+    for ( gf = (GlyphFace *) gs.faces.items, end = gf + gs.faces.nelements;
+          gf != end;
+          gf++ ) {
+        if ( gf->font != font )
+            continue;
+
+        if ( gf->set != None )
+            XRenderFreeGlyphSet (dpy, gf->set);
+        free (gf->loaded);
+
+        /* keep the list dense */
+        *gf = *(end - 1);
+        gs.faces.nelements--;
+        return;
+    }
+}
+
+void
+glyphset_free (Display *dpy)
+{
+    GlyphFace *gf, *end;
+
+    if ( gs.faces.items != NULL ) {
+        for ( gf = (GlyphFace *) gs.faces.items, end = gf + gs.faces.nelements;
+              gf != end;
+              gf++ ) {
+            if ( gf->set != None )
+                XRenderFreeGlyphSet (dpy, gf->set);
+            free (gf->loaded);
+        }
+        thunk_free (&gs.faces);
+    }
+    thunk_free (&gs.elts);
+    thunk_free (&gs.chars);
+    thunk_free (&gs.image);
+    memset (&gs, 0, sizeof (gs));
+}
+
+#endif  /* FEATURE_GLYPHSET */
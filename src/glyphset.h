@@ -0,0 +1,25 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _GLYPHSET_H_
+#define _GLYPHSET_H_
+
+#include <X11/Xft/Xft.h>
+
+
+/*
+ * XRender renderer of the glyphs: every font face gets its own GlyphSet the
+ * glyphs are uploaded to once, and a run of glyphs of one colour is sent in
+ * one XRenderCompositeText32 request.  The glyphs advance the pen by the
+ * cell width $cw the face was first used with, so the glyphs of a row one
+ * cell apart share an element.  Faces FreeType can't render to a grey
+ * bitmap (colour emoji) are drawn by Xft.
+ */
+
+void glyphset_draw (XftDraw *draw, const XftColor *color,
+        const XftGlyphFontSpec *specs, int len, int cw);
+void glyphset_prewarm (Display *dpy, XftFont *font, FT_UInt glyph, int cw);
+void glyphset_forget (Display *dpy, XftFont *font);
+void glyphset_free (Display *dpy);
+
+
+#endif  /* _GLYPHSET_H_ */
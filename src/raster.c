@@ -0,0 +1,169 @@
+/* See LICENSE file for copyright and license details. */
+
+#if defined (FEATURE_GLYPHSET) || defined (FEATURE_SHM)
+
+#include <string.h>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_SYNTHESIS_H
+
+#include "raster.h"
+
+
+static int raster_color (FT_Face, XftFont *, Thunk *, RasterGlyph *);
+
+
+void
+raster_mode (XftFont *font, RasterMode *rm)
+{
+    FcBool antialias, hinting, autohint;
+    int hintstyle;
+
+    if ( FcPatternGetBool (font->pattern, FC_ANTIALIAS, 0, &antialias) != FcResultMatch )
+        antialias = FcTrue;
+    if ( FcPatternGetBool (font->pattern, FC_HINTING, 0, &hinting) != FcResultMatch )
+        hinting = FcTrue;
+    if ( FcPatternGetBool (font->pattern, FC_AUTOHINT, 0, &autohint) != FcResultMatch )
+        autohint = FcFalse;
+    if ( FcPatternGetInteger (font->pattern, FC_HINT_STYLE, 0, &hintstyle) != FcResultMatch )
+        hintstyle = FC_HINT_FULL;
+    if ( FcPatternGetBool (font->pattern, FC_EMBOLDEN, 0, &rm->embolden) != FcResultMatch )
+        rm->embolden = FcFalse;
+    if ( FcPatternGetBool (font->pattern, FC_COLOR, 0, &rm->color) != FcResultMatch )
+        rm->color = FcFalse;
+
+    rm->load = FT_LOAD_DEFAULT;
+    rm->mode = FT_RENDER_MODE_NORMAL;
+    if ( !antialias ) {
+        rm->load |= FT_LOAD_TARGET_MONO;
+        rm->mode = FT_RENDER_MODE_MONO;
+    } else if ( hintstyle == FC_HINT_SLIGHT ) {
+        rm->load |= FT_LOAD_TARGET_LIGHT;
+        rm->mode = FT_RENDER_MODE_LIGHT;
+    }
+    if ( !hinting || hintstyle == FC_HINT_NONE )
+        rm->load |= FT_LOAD_NO_HINTING;
+    if ( autohint )
+        rm->load |= FT_LOAD_FORCE_AUTOHINT;
+}
+
+int
+raster_glyph (XftFont *font, const RasterMode *rm, FT_UInt glyph,
+        Thunk *image, RasterGlyph *rg)
+{
+    FT_Face face;
+    FT_GlyphSlot slot;
+    FT_Bitmap *bm;
+    byte *dst, *src;
+    uint y, x;
+    int ret = False;
+
+    /* the face comes with the size and transform of the font */
+    face = XftLockFace (font);
+    if ( face == NULL )
+        return False;
+
+    slot = face->glyph;
+    if ( glyph >= (FT_UInt) face->num_glyphs ||
+         FT_Load_Glyph (face, glyph, rm->load | (rm->color ? FT_LOAD_COLOR : 0)) != 0 )
+        goto unlock;
+    if ( rm->embolden )
+        FT_GlyphSlot_Embolden (slot);
+    if ( FT_Render_Glyph (slot, rm->mode) != 0 )
+        goto unlock;
+
+    bm = &slot->bitmap;
+    if ( bm->pixel_mode == FT_PIXEL_MODE_BGRA && rm->color ) {
+        ret = raster_color (face, font, image, rg);
+        goto unlock;
+    }
+    if ( bm->pixel_mode != FT_PIXEL_MODE_GRAY && bm->pixel_mode != FT_PIXEL_MODE_MONO )
+        goto unlock;
+
+    rg->color = False;
+    rg->width = bm->width;
+    rg->height = bm->rows;
+    rg->stride = (bm->width + 3) & ~3;
+    rg->left = slot->bitmap_left;
+    rg->top = slot->bitmap_top;
+
+    image->nelements = 0;
+    if ( rg->stride * rg->height > image->alloc_size )
+        thunk_double_size (image, rg->stride * rg->height);
+    dst = image->items;
+    memset (dst, 0, rg->stride * rg->height);
+
+    for ( y = 0; y < bm->rows; y++, dst += rg->stride ) {
+        src = bm->buffer + (int) y * bm->pitch;
+        if ( bm->pixel_mode == FT_PIXEL_MODE_GRAY )
+            memcpy (dst, src, bm->width);
+        else {
+            for ( x = 0; x < bm->width; x++ )
+                dst [x] = src [x >> 3] & (0x80 >> (x & 7)) ? 0xff : 0;
+        }
+    }
+    ret = True;
+
+unlock:
+    XftUnlockFace (font);
+    return ret;
+}
+
+/*
+ * The strikes of the bitmap faces (colour emoji mostly) are bigger than
+ * the font: they are scaled down to its pixel size, every pixel is the
+ * average of the ones it covers.
+ */
+int
+raster_color (FT_Face face, XftFont *font, Thunk *image, RasterGlyph *rg)
+{
+    FT_GlyphSlot slot = face->glyph;
+    FT_Bitmap *bm = &slot->bitmap;
+    double size, scale = 1;
+    uint x, y, sx, sx2, sy, sy2, i, j, n, sum [4];
+    byte *dst, *src;
+
+    if ( !FT_IS_SCALABLE (face) && face->size->metrics.y_ppem != 0 &&
+         FcPatternGetDouble (font->pattern, FC_PIXEL_SIZE, 0, &size) == FcResultMatch &&
+         size < face->size->metrics.y_ppem )
+        scale = size / face->size->metrics.y_ppem;
+
+    rg->color = True;
+    rg->width = bm->width * scale + 0.5;
+    rg->height = bm->rows * scale + 0.5;
+    rg->stride = rg->width * 4;
+    rg->left = slot->bitmap_left * scale;
+    rg->top = slot->bitmap_top * scale + 0.5;
+
+    image->nelements = 0;
+    if ( rg->stride * rg->height > image->alloc_size )
+        thunk_double_size (image, rg->stride * rg->height);
+    dst = image->items;
+
+    for ( y = 0; y < rg->height; y++ ) {
+        sy = y * bm->rows / rg->height;
+        sy2 = MAX ((y + 1) * bm->rows / rg->height, sy + 1);
+        for ( x = 0; x < rg->width; x++, dst += 4 ) {
+            sx = x * bm->width / rg->width;
+            sx2 = MAX ((x + 1) * bm->width / rg->width, sx + 1);
+
+            memset (sum, 0, sizeof (sum));
+            for ( j = sy; j < sy2; j++ ) {
+                src = bm->buffer + (int) j * bm->pitch + sx * 4;
+                for ( i = sx; i < sx2; i++, src += 4 ) {
+                    sum [0] += src [0];
+                    sum [1] += src [1];
+                    sum [2] += src [2];
+                    sum [3] += src [3];
+                }
+            }
+            n = (sy2 - sy) * (sx2 - sx);
+            for ( i = 0; i < 4; i++ )
+                dst [i] = sum [i] / n;
+        }
+    }
+    return True;
+}
+
+#endif  /* FEATURE_GLYPHSET || FEATURE_SHM */
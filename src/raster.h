@@ -0,0 +1,36 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _RASTER_H_
+#define _RASTER_H_
+
+#include <X11/Xft/Xft.h>
+#include "thunk.h"
+
+
+/*
+ * FreeType rasterizer of the glyphs for the renderers bypassing Xft.  The
+ * glyphs are rendered to A8 bitmaps with the antialias, hinting and
+ * embolden options of their font; the colour glyphs to premultiplied BGRA
+ * ones if the renderer asks for them.
+ */
+
+typedef struct {
+    FT_Int32 load;          /* FT_Load_Glyph flags */
+    FT_Render_Mode mode;
+    FcBool embolden;
+    FcBool color;           /* colour glyphs are rendered as BGRA */
+} RasterMode;
+
+typedef struct {
+    uint width, height;
+    uint stride;            /* rows are padded to 4 bytes */
+    int left, top;          /* bitmap offset from the origin */
+    int color;              /* BGRA: 4 bytes a pixel */
+} RasterGlyph;
+
+void raster_mode (XftFont *font, RasterMode *rm);
+int raster_glyph (XftFont *font, const RasterMode *rm, FT_UInt glyph,
+        Thunk *image, RasterGlyph *rg);
+
+
+#endif  /* _RASTER_H_ */
@@ -0,0 +1,255 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifdef FEATURE_HARFBUZZ
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hb.h>
+#include <hb-ft.h>
+
+#include "shape.h"
+#include "thunk.h"
+
+
+/* the cache is SHAPE_CACHE / SHAPE_WAYS sets of SHAPE_WAYS runs */
+#define SHAPE_WAYS  4
+#define SHAPE_SETS  (SHAPE_CACHE / SHAPE_WAYS)
+
+
+typedef struct {
+    XftFont *font;
+    hb_font_t *hb;      /* on the face the font keeps locked */
+} ShapeFace;
+
+typedef struct {
+    XftFont *font;      /* NULL: empty entry */
+    uint hash;
+    uint n;
+    Rune *runes;        /* the key; the glyphs follow it in the block */
+    ShapedGlyph *glyphs;
+    uint nglyphs;
+    ulong used;
+} ShapeRun;
+
+typedef struct {
+    Thunk faces;        /* ShapeFace */
+    hb_buffer_t *buf;
+    ShapeRun runs [SHAPE_CACHE];
+    ulong tick;
+    ulong hits;
+    ulong misses;
+} Shaper;
+
+
+static uint shape_hash (XftFont *, const Rune *, uint);
+static hb_font_t * shape_face (XftFont *);
+static void shape_drop (ShapeRun *);
+static void shape_fill (ShapeRun *, hb_font_t *, XftFont *, const Rune *, uint);
+
+
+static Shaper sh;
+
+
+uint
+shape_hash (XftFont *font, const Rune *runes, uint n)
+{
+    uint h;
+
+    /* FNV-1a */
+    h = 2166136261u ^ (uint) (uintptr_t) font;
+    for ( ; n != 0; n--, runes++ )
+        h = (h ^ *runes) * 16777619u;
+    return h;
+}
+
+hb_font_t *
+shape_face (XftFont *font)
+{
+    ShapeFace *sf, *end;
+    FT_Face face;
+
+    if ( sh.faces.items == NULL )
+        thunk_create (&sh.faces, 16, sizeof (ShapeFace));
+
+    for ( sf = (ShapeFace *) sh.faces.items, end = sf + sh.faces.nelements;
+          sf != end;
+          sf++ ) {
+        if ( sf->font == font )
+            return sf->hb;
+    }
+
+    /* Xft closes the unlocked faces when too many are open: the face is
+     * unlocked when the font is forgotten */
+    face = XftLockFace (font);
+    if ( face == NULL )
+        return NULL;
+
+    sf = (ShapeFace *) thunk_alloc_next (&sh.faces);
+    sf->font = font;
+    sf->hb = hb_ft_font_create (face, NULL);
+    return sf->hb;
+}
+
+void
+shape_drop (ShapeRun *sr)
+{
+    free (sr->runes);
+    sr->runes = NULL;
+    sr->font = NULL;
+}
+
+/*
+ * The terminal has no bidi: the runs are shaped left to right and every
+ * glyph is placed relative to the cell of its cluster, so the advances
+ * of the font don't move the glyphs off the grid.
+ */
+void
+shape_fill (ShapeRun *sr, hb_font_t *hb, XftFont *font, const Rune *runes, uint n)
+{
+    hb_glyph_info_t *info;
+    hb_glyph_position_t *pos;
+    ShapedGlyph *g;
+    uint i, len, cell;
+    int pen;
+
+    if ( sh.buf == NULL )
+        sh.buf = hb_buffer_create ();
+
+    hb_buffer_clear_contents (sh.buf);
+    hb_buffer_add_utf32 (sh.buf, runes, n, 0, n);
+    hb_buffer_set_direction (sh.buf, HB_DIRECTION_LTR);
+    hb_buffer_guess_segment_properties (sh.buf);
+
+    hb_shape (hb, sh.buf, NULL, 0);
+
+    info = hb_buffer_get_glyph_infos (sh.buf, &len);
+    pos = hb_buffer_get_glyph_positions (sh.buf, NULL);
+
+    /* one block: the runes, then the glyphs */
+    sr->runes = x_malloc (n * sizeof (Rune) + len * sizeof (ShapedGlyph));
+    memcpy (sr->runes, runes, n * sizeof (Rune));
+    sr->glyphs = (ShapedGlyph *) (sr->runes + n);
+    sr->nglyphs = len;
+    sr->n = n;
+    sr->font = font;
+
+    for ( i = 0, pen = 0, cell = UINT_MAX, g = sr->glyphs; i < len; i++, g++ ) {
+        /* the pen restarts at the cell of every cluster */
+        if ( info [i].cluster != cell ) {
+            cell = info [i].cluster;
+            pen = 0;
+        }
+        g->glyph = info [i].codepoint;
+        g->cell = cell;
+        g->x = (pen + pos [i].x_offset) >> 6;
+        g->y = -pos [i].y_offset >> 6;
+        pen += pos [i].x_advance;
+    }
+}
+
+const ShapedGlyph *
+shape_run (XftFont *font, const Rune *runes, uint n, uint *nglyphs)
+{
+    ShapeRun *set, *sr, *lru;
+    hb_font_t *hb;
+    uint hash, i;
+
+    hash = shape_hash (font, runes, n);
+    set = sh.runs + (hash & (SHAPE_SETS - 1)) * SHAPE_WAYS;
+    sh.tick++;
+
+    for ( i = 0, sr = set, lru = set; i < SHAPE_WAYS; i++, sr++ ) {
+        if ( sr->font == font && sr->hash == hash && sr->n == n &&
+             memcmp (sr->runes, runes, n * sizeof (Rune)) == 0 ) {
+            sr->used = sh.tick;
+            sh.hits++;
+            *nglyphs = sr->nglyphs;
+            return sr->glyphs;
+        }
+        if ( sr->used < lru->used )
+            lru = sr;
+    }
+    sh.misses++;
+
+    hb = shape_face (font);
+    if ( hb == NULL )
+        return NULL;
+
+    /* the least recently used run of the set is replaced */
+    if ( lru->font != NULL )
+        shape_drop (lru);
+    shape_fill (lru, hb, font, runes, n);
+    lru->hash = hash;
+    lru->used = sh.tick;
+
+    *nglyphs = lru->nglyphs;
+    return lru->glyphs;
+}
+
+void
+shape_stats (ulong *hits, ulong *misses)
+{
+    *hits = sh.hits;
+    *misses = sh.misses;
+}
+
+/* the font is closed: its runs and face go */
+void
+shape_forget (XftFont *font)
+{
+    ShapeFace *sf, *end;
+    ShapeRun *sr;
+    uint i;
+
+    for ( i = 0, sr = sh.runs; i < SHAPE_CACHE; i++, sr++ ) {
+        if ( sr->font == font ) {
+            shape_drop (sr);
+            sr->used = 0;
+        }
+    }
+
+    if ( sh.faces.items == NULL )
+        return;
+
+    for ( sf = (ShapeFace *) sh.faces.items, end = sf + sh.faces.nelements;
+          sf != end;
+          sf++ ) {
+        if ( sf->font != font )
+            continue;
+
+        hb_font_destroy (sf->hb);
+        XftUnlockFace (font);
+
+        /* keep the list dense */
+        *sf = *(end - 1);
+        sh.faces.nelements--;
+        return;
+    }
+}
+
+void
+shape_free (void)
+{
+    ShapeFace *sf, *end;
+    uint i;
+
+    for ( i = 0; i < SHAPE_CACHE; i++ )
+        free (sh.runs [i].runes);
+
+    if ( sh.faces.items != NULL ) {
+        for ( sf = (ShapeFace *) sh.faces.items, end = sf + sh.faces.nelements;
+              sf != end;
+              sf++ ) {
+            hb_font_destroy (sf->hb);
+            XftUnlockFace (sf->font);
+        }
+        thunk_free (&sh.faces);
+    }
+    if ( sh.buf != NULL )
+        hb_buffer_destroy (sh.buf);
+    memset (&sh, 0, sizeof (sh));
+}
+
+#endif  /* FEATURE_HARFBUZZ */
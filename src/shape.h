@@ -0,0 +1,30 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _SHAPE_H_
+#define _SHAPE_H_
+
+#include <X11/Xft/Xft.h>
+#include "st.h"
+
+
+/* a shaped glyph: its offset from the origin of the cell of its rune */
+typedef struct {
+    FT_UInt glyph;
+    uint cell;          /* index of the rune in the run */
+    short x, y;
+} ShapedGlyph;
+
+
+/*
+ * HarfBuzz shaping of the runs of one font: ligatures and the forms of the
+ * complex scripts.  The results are kept in a cache keyed by the font and
+ * the runes of the run, the least recently used one is dropped.
+ */
+
+const ShapedGlyph * shape_run (XftFont *font, const Rune *runes, uint n, uint *nglyphs);
+void shape_stats (ulong *hits, ulong *misses);
+void shape_forget (XftFont *font);
+void shape_free (void);
+
+
+#endif  /* _SHAPE_H_ */
@@ -0,0 +1,396 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifdef FEATURE_SHM
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include "raster.h"
+#include "soft.h"
+#include "st.h"
+
+
+/* rasterized glyphs kept: a direct-mapped cache */
+#define SOFT_SLOTS  4096
+
+/* t / 255 rounded, for t <= 255 * 255 */
+#define DIV255(t)  (((t) + 128 + (((t) + 128) >> 8)) >> 8)
+
+
+typedef struct {
+    XftFont *font;      /* NULL: empty slot */
+    FT_UInt glyph;
+    RasterGlyph rg;
+    byte *mask;         /* NULL: nothing to draw; BGRA if $rg.color */
+} SoftGlyph;
+
+typedef struct {
+    Display *dpy;
+    XImage *image;
+    XShmSegmentInfo shm;
+    int shared;         /* the image is in shared memory */
+    byte *save;         /* image of the primary screen */
+    SoftGlyph *slots;
+    Thunk bitmap;       /* byte: raster_glyph output */
+} Soft;
+
+
+static int soft_shm_error (Display *, XErrorEvent *);
+static int soft_create_shm (Visual *, int, uint, uint);
+static void soft_image_free (void);
+static SoftGlyph * soft_glyph (XftFont *, FT_UInt);
+static void soft_blend (const SoftGlyph *, int, int, const XRectangle *, const XftColor *);
+
+
+static Soft soft;
+static int shm_failed;
+
+
+int
+soft_shm_error (Display *dpy, XErrorEvent *ev)
+{
+    /* remote servers refuse to attach the segment */
+    shm_failed = True;
+    return 0;
+}
+
+int
+soft_create_shm (Visual *vis, int depth, uint w, uint h)
+{
+    XErrorHandler handler;
+
+    soft.image = XShmCreateImage (soft.dpy, vis, depth, ZPixmap, NULL, &soft.shm, w, h);
+    if ( soft.image == NULL )
+        return False;
+
+    soft.shm.shmid = shmget (IPC_PRIVATE, soft.image->bytes_per_line * h, IPC_CREAT | 0600);
+    if ( soft.shm.shmid == -1 )
+        goto destroy;
+
+    soft.shm.shmaddr = soft.image->data = shmat (soft.shm.shmid, NULL, 0);
+    soft.shm.readOnly = False;
+    if ( soft.shm.shmaddr == (char *) -1 ) {
+        shmctl (soft.shm.shmid, IPC_RMID, NULL);
+        goto destroy;
+    }
+
+    shm_failed = False;
+    handler = XSetErrorHandler (soft_shm_error);
+    XShmAttach (soft.dpy, &soft.shm);
+    XSync (soft.dpy, False);
+    XSetErrorHandler (handler);
+
+    /* the segment goes away with the last detach */
+    shmctl (soft.shm.shmid, IPC_RMID, NULL);
+    if ( !shm_failed ) {
+        soft.shared = True;
+        return True;
+    }
+    shmdt (soft.shm.shmaddr);
+
+destroy:
+    soft.image->data = NULL;
+    XDestroyImage (soft.image);
+    soft.image = NULL;
+    return False;
+}
+
+int
+soft_create (Display *dpy, Visual *vis, int depth, uint w, uint h)
+{
+    soft_image_free ();
+    soft.dpy = dpy;
+
+    /* the pixels are written as 0xAARRGGBB */
+    if ( vis->class != TrueColor || vis->red_mask != 0xff0000 ||
+         vis->green_mask != 0xff00 || vis->blue_mask != 0xff )
+        return False;
+
+    if ( !XShmQueryExtension (dpy) || !soft_create_shm (vis, depth, w, h) ) {
+        soft.image = XCreateImage (dpy, vis, depth, ZPixmap, 0, NULL, w, h, 32, 0);
+        if ( soft.image == NULL )
+            return False;
+        soft.image->data = x_malloc (soft.image->bytes_per_line * h);
+    }
+
+    if ( soft.image->bits_per_pixel != 32 ) {
+        soft_image_free ();
+        return False;
+    }
+
+    if ( soft.slots == NULL ) {
+        soft.slots = x_malloc (SOFT_SLOTS * sizeof (SoftGlyph));
+        memset (soft.slots, 0, SOFT_SLOTS * sizeof (SoftGlyph));
+        thunk_create (&soft.bitmap, 1024, sizeof (byte));
+    }
+    return True;
+}
+
+void
+soft_image_free (void)
+{
+    free (soft.save);
+    soft.save = NULL;
+
+    if ( soft.image == NULL )
+        return;
+
+    if ( soft.shared ) {
+        XShmDetach (soft.dpy, &soft.shm);
+        shmdt (soft.shm.shmaddr);
+        soft.image->data = NULL;
+        soft.shared = False;
+    }
+    XDestroyImage (soft.image);
+    soft.image = NULL;
+}
+
+void
+soft_destroy (void)
+{
+    SoftGlyph *sg;
+    uint i;
+
+    soft_image_free ();
+
+    if ( soft.slots != NULL ) {
+        for ( i = SOFT_SLOTS, sg = soft.slots; i != 0; i--, sg++ )
+            free (sg->mask);
+        free (soft.slots);
+        soft.slots = NULL;
+        thunk_free (&soft.bitmap);
+    }
+}
+
+void
+soft_fill (ulong pixel, int x, int y, uint w, uint h)
+{
+    uint32_t *d;
+    int x2, y2, i;
+    char *row;
+
+    x2 = x + (int) w;
+    y2 = y + (int) h;
+    if ( x < 0 )
+        x = 0;
+    if ( y < 0 )
+        y = 0;
+    if ( x2 > soft.image->width )
+        x2 = soft.image->width;
+    if ( y2 > soft.image->height )
+        y2 = soft.image->height;
+
+    for ( row = soft.image->data + y * soft.image->bytes_per_line;
+          y < y2;
+          y++, row += soft.image->bytes_per_line ) {
+        d = (uint32_t *) row;
+        for ( i = x; i < x2; i++ )
+            d [i] = pixel;
+    }
+}
+
+void
+soft_fill_rects (ulong pixel, const XRectangle *rects, uint n)
+{
+    for ( ; n != 0; n--, rects++ )
+        soft_fill (pixel, rects->x, rects->y, rects->width, rects->height);
+}
+
+SoftGlyph *
+soft_glyph (XftFont *font, FT_UInt glyph)
+{
+    SoftGlyph *sg;
+    RasterMode mode;
+    uint size;
+
+    sg = soft.slots + ((glyph * 31 + ((uintptr_t) font >> 4)) & (SOFT_SLOTS - 1));
+    if ( sg->font == font && sg->glyph == glyph )
+        return sg;
+
+    /* replace the slot */
+    free (sg->mask);
+    sg->mask = NULL;
+    sg->font = font;
+    sg->glyph = glyph;
+
+    raster_mode (font, &mode);
+    if ( raster_glyph (font, &mode, glyph, &soft.bitmap, &sg->rg) ) {
+        size = sg->rg.stride * sg->rg.height;
+        if ( size != 0 ) {
+            sg->mask = x_malloc (size);
+            memcpy (sg->mask, soft.bitmap.items, size);
+        }
+    }
+    return sg;
+}
+
+void
+soft_blend (const SoftGlyph *sg, int ox, int oy, const XRectangle *clip,
+        const XftColor *color)
+{
+    uint32_t *d, p;
+    const byte *m;
+    uint r, g, b, a, na;
+    int x1, y1, x2, y2, bx, by, i, w;
+    char *row;
+
+    /* the bitmap in the image (and the clip) */
+    bx = ox + sg->rg.left;
+    by = oy - sg->rg.top;
+    x1 = MAX (bx, 0);
+    y1 = MAX (by, 0);
+    x2 = MIN (bx + (int) sg->rg.width, soft.image->width);
+    y2 = MIN (by + (int) sg->rg.height, soft.image->height);
+    if ( clip != NULL ) {
+        x1 = MAX (x1, clip->x);
+        y1 = MAX (y1, clip->y);
+        x2 = MIN (x2, clip->x + (int) clip->width);
+        y2 = MIN (y2, clip->y + (int) clip->height);
+    }
+    if ( x1 >= x2 || y1 >= y2 )
+        return;
+
+    w = x2 - x1;
+
+    /* the colour glyphs are premultiplied: over the image as they are */
+    if ( sg->rg.color ) {
+        for ( row = soft.image->data + y1 * soft.image->bytes_per_line;
+              y1 < y2;
+              y1++, row += soft.image->bytes_per_line ) {
+            d = (uint32_t *) row + x1;
+            m = sg->mask + (y1 - by) * sg->rg.stride + (x1 - bx) * 4;
+            for ( i = 0; i < w; i++, m += 4 ) {
+                na = 255 - m [3];
+                p = d [i];
+                d [i] = (p & 0xff000000) |
+                    (m [2] + DIV255 (((p >> 16) & 0xff) * na)) << 16 |
+                    (m [1] + DIV255 (((p >> 8) & 0xff) * na)) << 8 |
+                    (m [0] + DIV255 ((p & 0xff) * na));
+            }
+        }
+        return;
+    }
+
+    r = color->color.red >> 8;
+    g = color->color.green >> 8;
+    b = color->color.blue >> 8;
+
+    /* no branches in the inner loop: the compiler vectorizes it */
+    for ( row = soft.image->data + y1 * soft.image->bytes_per_line;
+          y1 < y2;
+          y1++, row += soft.image->bytes_per_line ) {
+        d = (uint32_t *) row + x1;
+        m = sg->mask + (y1 - by) * sg->rg.stride + (x1 - bx);
+        for ( i = 0; i < w; i++ ) {
+            a = m [i];
+            na = 255 - a;
+            p = d [i];
+            d [i] = (p & 0xff000000) |
+                DIV255 (((p >> 16) & 0xff) * na + r * a) << 16 |
+                DIV255 (((p >> 8) & 0xff) * na + g * a) << 8 |
+                DIV255 ((p & 0xff) * na + b * a);
+        }
+    }
+}
+
+void
+soft_glyphs (const XftColor *color, const XftGlyphFontSpec *specs, int len,
+        const XRectangle *clip)
+{
+    SoftGlyph *sg;
+
+    for ( ; len != 0; len--, specs++ ) {
+        sg = soft_glyph (specs->font, specs->glyph);
+        if ( sg->mask != NULL )
+            soft_blend (sg, specs->x, specs->y, clip, color);
+    }
+}
+
+void
+soft_prewarm (XftFont *font, FT_UInt glyph)
+{
+    soft_glyph (font, glyph);
+}
+
+void
+soft_copy_rows (int src, int dst, uint h)
+{
+    int bpl = soft.image->bytes_per_line;
+
+    if ( src < 0 || dst < 0 ||
+         src + (int) h > soft.image->height || dst + (int) h > soft.image->height )
+        return;
+
+    memmove (soft.image->data + dst * bpl, soft.image->data + src * bpl, h * bpl);
+}
+
+void
+soft_put (Drawable d, GC gc, int x, int y, uint w, uint h)
+{
+    if ( x + w > (uint) soft.image->width )
+        w = soft.image->width - x;
+    if ( y + h > (uint) soft.image->height )
+        h = soft.image->height - y;
+
+    if ( soft.shared )
+        XShmPutImage (soft.dpy, d, gc, soft.image, x, y, x, y, w, h, False);
+    else
+        XPutImage (soft.dpy, d, gc, soft.image, x, y, x, y, w, h);
+}
+
+void
+soft_sync (void)
+{
+    /* the server reads the shared image: it must be done before the next
+     * frame writes to it */
+    if ( soft.shared )
+        XSync (soft.dpy, False);
+}
+
+void
+soft_save (void)
+{
+    uint size = soft.image->bytes_per_line * soft.image->height;
+
+    if ( soft.save == NULL )
+        soft.save = x_malloc (size);
+    memcpy (soft.save, soft.image->data, size);
+}
+
+int
+soft_restore (void)
+{
+    if ( soft.save == NULL )
+        return False;
+
+    memcpy (soft.image->data, soft.save, soft.image->bytes_per_line * soft.image->height);
+    return True;
+}
+
+/* the font is closed: its address may be taken by the next one */
+void
+soft_forget (XftFont *font)
+{
+    SoftGlyph *sg;
+    uint i;
+
+    if ( soft.slots == NULL )
+        return;
+
+    for ( i = SOFT_SLOTS, sg = soft.slots; i != 0; i--, sg++ ) {
+        if ( sg->font != font )
+            continue;
+        free (sg->mask);
+        sg->mask = NULL;
+        sg->font = NULL;
+    }
+}
+
+#endif  /* FEATURE_SHM */
@@ -0,0 +1,32 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _SOFT_H_
+#define _SOFT_H_
+
+#include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
+
+
+/*
+ * Client-side renderer: the screen is drawn to an XImage (in shared memory
+ * if the X server can attach it) and the damaged regions are put to the
+ * window.  Only 32 bits per pixel TrueColor visuals are drawn, soft_create
+ * fails on the others and the server draws the screen.
+ */
+
+int soft_create (Display *dpy, Visual *vis, int depth, uint w, uint h);
+void soft_destroy (void);
+void soft_fill (ulong pixel, int x, int y, uint w, uint h);
+void soft_fill_rects (ulong pixel, const XRectangle *rects, uint n);
+void soft_glyphs (const XftColor *color, const XftGlyphFontSpec *specs, int len,
+        const XRectangle *clip);
+void soft_prewarm (XftFont *font, FT_UInt glyph);
+void soft_copy_rows (int src, int dst, uint h);
+void soft_put (Drawable d, GC gc, int x, int y, uint w, uint h);
+void soft_sync (void);
+void soft_save (void);
+int soft_restore (void);
+void soft_forget (XftFont *font);
+
+
+#endif  /* _SOFT_H_ */
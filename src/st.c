@@ -13,7 +13,13 @@
 #include <sys/select.h>
 #include <sys/wait.h>
 
+#ifdef FEATURE_TTY_THREAD
+#include <pthread.h>
+#include <stdatomic.h>
+#endif  /* FEATURE_TTY_THREAD */
+
 #include "args.h"
+#include "cluster.h"
 #include "win.h"
 #include "thunk.h"
 #include "strutil.h"
@@ -36,6 +42,10 @@
 #define STR_BUF_SIZ  ESC_BUF_SIZ
 #define STR_ARG_SIZ  ESC_ARG_SIZ
 
+/* palette entries tracked by the targeted redraw; a change of the others
+ * redraws everything */
+#define RECOLOR_MAX  1024
+
 /* macros */
 #define term_flag(f)  (term.flags & (f))
 
@@ -117,6 +127,11 @@ typedef struct {
     Cell p;
 } TermCursor;
 
+typedef struct {
+    uint top, bottom;  /* scrolled region */
+    int n;             /* rows: > 0 up, < 0 down, 0 nothing is pending */
+} ScrollBlit;
+
 typedef struct {
     Cell ob;  /* original coordinates of the beginning of the selection */
     Cell oe;  /* original coordinates of the end of the selection */
@@ -137,10 +152,12 @@ typedef struct {
     Line *line;              /* screen */
     Line *alt;               /* alternate screen */
     int *dirty;              /* dirtyness of lines (boolean) */
+    int *savedirty;          /* dirtyness of the saved primary screen */
     int *tabs;               /* boolean */
     TermCursor c;            /* cursor */
     StackCursor cstack [2];  /* cursor stack */
     Cell oc;                 /* old cursor column and row */
+    ScrollBlit blit;         /* scroll pending in the drawn screen */
     uint top, bottom;        /* top/bottom scroll limit */
     TermFlags flags;         /* terminal flags */
     byte trantbl [4];        /* charset table translation */
@@ -148,6 +165,8 @@ typedef struct {
     int icharset;            /* selected charset for sequence */
     Rune lastu;              /* last printed char outside of sequence, 0 if control */
     Selection sel;           /* selection */
+    byte recolor [RECOLOR_MAX >> 3];  /* palette entries changed since the last frame */
+    int recolorall;          /* redraw everything for them */
 #ifdef FEATURE_TITLE
     Title *titles;
     Title *icontitles;
@@ -176,6 +195,26 @@ typedef struct {
     uint narg;             /* args # */
 } STREscape;
 
+#ifdef FEATURE_TTY_THREAD
+/*
+ * The parser runs on its own thread.  $term guards the terminal: the
+ * parser holds it while it parses a buffer, the main loop while it handles
+ * the events and takes the snapshot of a frame.  $x guards Xlib, the
+ * window, the colours and the clusters: the main loop holds it but while
+ * it waits, the parser takes it around each of its X calls only.  $term is
+ * taken first.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t term;
+    pthread_mutex_t x;
+    int xheld;             /* depth of the parser's tty_x_lock calls */
+    atomic_int signaled;   /* a byte is in the wake pipe */
+    atomic_int error;      /* 0, errno of the failed read or -1: end of file */
+    int wake [2];          /* pipe: the parser wakes the main loop */
+} TtyThread;
+#endif  /* FEATURE_TTY_THREAD */
+
 
 static void execsh(const char **argv, uint argn);
 static void stty(const char **argv, uint argn);
@@ -183,6 +222,13 @@ static void sigchld(int);
 
 /* tty */
 static void tty_write_raw (const char *, uint n);
+static uint tty_drain (uint);
+#ifdef FEATURE_TTY_THREAD
+static int tty_thread_start (void);
+static void * tty_thread (void *);
+static void tty_thread_wake (void);
+static int tty_parse (void);
+#endif  /* FEATURE_TTY_THREAD */
 
 /* OSC */
 static void osc_color_response(int index, int id);
@@ -229,7 +275,9 @@ static void tline_snap_word_next (uint *col, uint *row);
 static void tregion_clear (uint, uint, uint, uint);
 static void tregion_draw (uint, uint, uint, uint);
 static void tregion_verbose (void);
-static int tregion_is_sel (void);
+static int tregion_is_sel (const Term *);
+static int tregion_selected (const Term *, uint col, uint row);
+static int tregion_sel_margin (const Term *, uint row, uint *, uint *);
 
 /* cursor */
 static void tcursor_load (void);
@@ -248,9 +296,16 @@ static void t_movea_to (uint col, uint row);
 static void t_put_next_tab (uint n);
 static void t_put_prev_tab (uint n);
 static void t_putc (Rune);
+static void t_cluster_add (Rune);
+static uint t_clusters_sweep (void);
+static uint t_glyph_encode (const TermGlyph *, char *);
 static void t_reset (void);
 static void t_scroll_up (uint orig, uint n);
 static void t_scroll_down  (uint orig, uint n);
+static void t_scroll_blit (uint orig, int n);
+#ifdef FEATURE_TTY_THREAD
+static void t_snapshot (void);
+#endif  /* FEATURE_TTY_THREAD */
 static void t_set_attr (void);
 static void t_set_char (Rune, uint col, uint row);
 static void t_set_dirt (uint top, uint bottom);
@@ -259,6 +314,7 @@ static void t_swap_screen (void);
 static void t_set_mode (int);
 static uint t_write (const char *buf, uint len, int);
 static void t_full_dirt (void);
+static void t_recolor_dirt (void);
 static void t_control_code (uchar );
 static void t_dec_test (char );
 static void t_def_utf8 (char);
@@ -308,6 +364,14 @@ static int iofd = 1;
 static int cmdfd;
 static pid_t pid;
 
+#ifdef FEATURE_TTY_THREAD
+static TtyThread tt;
+static Term snap;          /* the rows t_draw draws while the parser goes on */
+#define view  snap
+#else
+#define view  term
+#endif  /* FEATURE_TTY_THREAD */
+
 /* sync update globals */
 #ifdef FEATURE_SYNC_UPDATE
 static struct timespec tsu_stamp;
@@ -613,7 +677,7 @@ tline_len (Line line)
     if ( line->attr & ATTR_WRAP )
         return i;
 
-    while ( i != 0 && line->rune == ' ' ) {
+    while ( i != 0 && line->rune == ' ' && line->cluster == 0 ) {
         i--;
         line--;
     }
@@ -707,30 +771,37 @@ sel_normalize (void)
     sel_snap_next (&term.sel.ne.col, &term.sel.ne.row);
 }
 
+/* the selection drawn: t_draw and the cursor ask */
 int
 t_selected (uint col, uint row)
+{
+    return tregion_selected (&view, col, row);
+}
+
+int
+tregion_selected (const Term *t, uint col, uint row)
 {
     uint cmin, cmax;
 
-    if ( !tregion_is_sel () )
+    if ( !tregion_is_sel (t) )
         return False;
 
-    if ( !tline_sel_get_margin (row, &cmin, &cmax) )
+    if ( !tregion_sel_margin (t, row, &cmin, &cmax) )
         return False;
 
     return BETWEEN (col, cmin, cmax);
 }
 
 int
-tregion_is_sel (void)
+tregion_is_sel (const Term *t)
 {
     uint altscreen;
 
-    if ( term.sel.oe.col == UINT_MAX )
+    if ( t->sel.oe.col == UINT_MAX )
         return False;
 
     /* alt screen mode must be the same with selection's alt screen */
-    altscreen = term_flag (MODE_ALTSCREEN | SEL_ALTSCREEN);
+    altscreen = t->flags & (MODE_ALTSCREEN | SEL_ALTSCREEN);
     return altscreen == 0 ||
            altscreen == (MODE_ALTSCREEN | SEL_ALTSCREEN); 
 }
@@ -738,18 +809,24 @@ tregion_is_sel (void)
 int
 tline_sel_get_margin (uint row, uint *col1, uint *col2)
 {
-    if ( row < term.sel.nb.row ||
-         row > term.sel.ne.row )
+    return tregion_sel_margin (&view, row, col1, col2);
+}
+
+int
+tregion_sel_margin (const Term *t, uint row, uint *col1, uint *col2)
+{
+    if ( row < t->sel.nb.row ||
+         row > t->sel.ne.row )
         return False;
 
     /* rectangle? */
-    if ( term_flag (SEL_RECT) ) {
-        *col1 = term.sel.nb.col;
-        *col2 = term.sel.ne.col;
+    if ( t->flags & SEL_RECT ) {
+        *col1 = t->sel.nb.col;
+        *col2 = t->sel.ne.col;
     } else {
         /* regular */
-        *col1 = row == term.sel.nb.row ? term.sel.nb.col : 0;
-        *col2 = row == term.sel.ne.row ? term.sel.ne.col : term.size.col - 1;
+        *col1 = row == t->sel.nb.row ? t->sel.nb.col : 0;
+        *col2 = row == t->sel.ne.row ? t->sel.ne.col : t->size.col - 1;
     }
 
     return True;
@@ -943,7 +1020,8 @@ sel_get (void)
     if ( term.sel.ob.col == UINT_MAX )
         return NULL;
 
-    bufsize = (term.size.col + 1) * (term.sel.ne.row - term.sel.nb.row + 1) * UTF_SIZ;
+    bufsize = (term.size.col * (1 + CLUSTER_MARKS) + 1) *
+              (term.sel.ne.row - term.sel.nb.row + 1) * UTF_SIZ;
     ret = s = x_malloc (bufsize);
 
     /* append every set & selected glyph to the selection */
@@ -975,14 +1053,14 @@ sel_get (void)
             prevcol = linelen;
 
         last += prevcol;
-        while ( last >= tg && last->rune == ' ' )
+        while ( last >= tg && last->rune == ' ' && last->cluster == 0 )
             last--;
 
         for ( ; tg <= last; tg++ ) {
             if ( tg->attr & ATTR_WDUMMY )
                 continue;
 
-            s += utf8_encode (tg->rune, s);
+            s += t_glyph_encode (tg, s);
         }
 
         /* Copy and pasting of line endings is inconsistent in the
@@ -1004,6 +1082,16 @@ sel_get (void)
 void
 sel_clear (void)
 {
+    uint row;
+
+    /* selection of the saved primary screen? */
+    if ( term.sel.oe.col != UINT_MAX && !tregion_is_sel (&term) ) {
+        for ( row = term.sel.nb.row;
+              row <= term.sel.ne.row && row < term.size.row;
+              row++ )
+            term.savedirty [row] = True;
+    }
+
     term.sel.oe.col = UINT_MAX;
     term.flags &= ~SEL_MASK;
 
@@ -1020,6 +1108,8 @@ x_exit (void)
 void
 die (void)
 {
+    /* on the parser thread: the frame being drawn goes first */
+    tty_x_lock ();
     x_free ();
     exit (EXIT_FAILURE);
 }
@@ -1199,7 +1289,7 @@ tty_new (const char **argv, uint argn)
 
         dup2 (cmdfd, 0);
         stty (argv, argn);
-        return cmdfd;
+        goto reader;
     }
 
     /* seems to work fine on linux, openbsd and freebsd */
@@ -1255,9 +1345,179 @@ tty_new (const char **argv, uint argn)
             break;
     }
 
+reader:
+#ifdef FEATURE_TTY_THREAD
+    return tty_thread_start ();
+#else
     return cmdfd;
+#endif  /* FEATURE_TTY_THREAD */
 }
 
+#ifdef FEATURE_TTY_THREAD
+/*
+ * The tty is read and parsed by a thread: the child doesn't stall on a
+ * full pty while the X requests of a frame block, and the frame is drawn
+ * while the next buffer is parsed.  The main loop waits on the returned
+ * read end of the wake pipe and holds both locks from now on but while it
+ * waits.
+ */
+int
+tty_thread_start (void)
+{
+    sigset_t all, old;
+
+    if ( pipe (tt.wake) < 0 ) {
+        error ("pipe failed: %s", strerror(errno));
+        die ();
+        /* NOP */
+    }
+    fcntl (tt.wake [0], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init (&tt.term, NULL);
+    pthread_mutex_init (&tt.x, NULL);
+    tty_lock ();
+
+    /* the signals are handled by the main thread */
+    sigfillset (&all);
+    pthread_sigmask (SIG_SETMASK, &all, &old);
+    if ( pthread_create (&tt.thread, NULL, tty_thread, NULL) != 0 ) {
+        error ("couldn't start the tty parser");
+        die ();
+        /* NOP */
+    }
+    pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+    return tt.wake [0];
+}
+
+/* one byte in the pipe stands for any number of buffers */
+void
+tty_thread_wake (void)
+{
+    if ( atomic_exchange (&tt.signaled, True) )
+        return;
+
+    while ( write (tt.wake [1], "", 1) < 0 && errno == EINTR )
+        /* nothing */ ;
+}
+
+void *
+tty_thread (void *arg)
+{
+    fd_set rfd;
+    int ret;
+
+    for ( ;; ) {
+        /* the output is waited for without the terminal */
+        FD_ZERO (&rfd);
+        FD_SET (cmdfd, &rfd);
+        if ( pselect (cmdfd + 1, &rfd, NULL, NULL, NULL, NULL) < 0 ) {
+            atomic_store (&tt.error, errno);
+            tty_thread_wake ();
+            return NULL;
+        }
+
+        pthread_mutex_lock (&tt.term);
+        ret = tty_parse ();
+        pthread_mutex_unlock (&tt.term);
+
+        tty_thread_wake ();
+        if ( ret <= 0 )
+            return NULL;
+    }
+}
+
+/*
+ * One buffer is read and parsed on the parser thread, which holds the
+ * terminal.  The end of file and the errors are left to the main loop.
+ */
+int
+tty_parse (void)
+{
+    static char buf [BUFSIZ];
+    static uint buflen = 0;
+    uint written;
+    int ret;
+
+    ret = read (cmdfd, buf + buflen, LEN (buf) - buflen);
+    if ( ret <= 0 ) {
+        atomic_store (&tt.error, ret == 0 ? -1 : errno);
+        return ret;
+    }
+
+    buflen += ret;
+    written = t_write  (buf, buflen, False);
+    buflen -= written;
+    /* keep any incomplete UTF-8 byte sequence for the next call */
+    if ( buflen != 0 )
+        memmove (buf, buf + written, buflen);
+    return ret;
+}
+
+/*
+ * The main loop is woken by the parser: the buffers are parsed already,
+ * the wake pipe is emptied and the parser's end is handled here.
+ */
+uint
+tty_read (void)
+{
+    char drain [16];
+    int err;
+
+    /* emptied first: a buffer parsed meanwhile signals again */
+    while ( read (tt.wake [0], drain, sizeof (drain)) > 0 )
+        /* nothing */ ;
+    atomic_store (&tt.signaled, False);
+
+    err = atomic_load (&tt.error);
+    if ( err == -1 )
+        x_exit ();
+    if ( err != 0 ) {
+        error ("couldn't read from shell: %s", strerror(err));
+        die ();
+        /* NOP */
+    }
+    return 1;
+}
+
+/* the main thread: the terminal, then the window */
+void
+tty_lock (void)
+{
+    pthread_mutex_lock (&tt.term);
+    pthread_mutex_lock (&tt.x);
+}
+
+void
+tty_unlock (void)
+{
+    pthread_mutex_unlock (&tt.x);
+    pthread_mutex_unlock (&tt.term);
+}
+
+/*
+ * The parser thread calls Xlib or changes the window, the colours or the
+ * clusters: it waits for the frame being drawn.  The calls nest (die).
+ */
+void
+tty_x_lock (void)
+{
+    if ( !pthread_equal (pthread_self (), tt.thread) )
+        return;
+
+    if ( tt.xheld++ == 0 )
+        pthread_mutex_lock (&tt.x);
+}
+
+void
+tty_x_unlock (void)
+{
+    if ( !pthread_equal (pthread_self (), tt.thread) )
+        return;
+
+    if ( --tt.xheld == 0 )
+        pthread_mutex_unlock (&tt.x);
+}
+#else
 uint
 tty_read (void)
 {
@@ -1299,6 +1559,7 @@ write:
             return ret;
     }
 }
+#endif  /* FEATURE_TTY_THREAD */
 
 void
 tty_write (const char *s, uint n, int may_echo)
@@ -1333,9 +1594,16 @@ void
 tty_write_raw (const char *s, uint n)
 {
     fd_set wfd, rfd;
-    int ret;
+    int ret, parse;
     uint lim = 256;
 
+#ifdef FEATURE_TTY_THREAD
+    /* the main thread lets the parser read the output while it waits */
+    parse = pthread_equal (pthread_self (), tt.thread);
+#else
+    parse = True;
+#endif  /* FEATURE_TTY_THREAD */
+
     /* Remember that we are using a pty, which might be a modem line.
      * Writing too much will clog the line.  That's why we are doing
      * this dance.
@@ -1345,10 +1613,20 @@ tty_write_raw (const char *s, uint n)
         FD_ZERO (&rfd);
 
         FD_SET (cmdfd, &wfd);
-        FD_SET (cmdfd, &rfd);
+        if ( parse )
+            FD_SET (cmdfd, &rfd);
 
         /* Check if we can write. */
-        if ( pselect (cmdfd + 1, &rfd, &wfd, NULL, NULL, NULL) < 0 ) {
+#ifdef FEATURE_TTY_THREAD
+        if ( !parse )
+            tty_unlock ();
+#endif  /* FEATURE_TTY_THREAD */
+        ret = pselect (cmdfd + 1, &rfd, &wfd, NULL, NULL, NULL);
+#ifdef FEATURE_TTY_THREAD
+        if ( !parse )
+            tty_lock ();
+#endif  /* FEATURE_TTY_THREAD */
+        if ( ret < 0 ) {
             if (errno == EINTR)
                 continue;
             error ("select failed: %s", strerror(errno));
@@ -1375,15 +1653,15 @@ tty_write_raw (const char *s, uint n)
              * This means the buffer is getting full
              * again. Empty it.
              */
-            if ( n < lim )
-                lim = tty_read ();
+            if ( n < lim && parse )
+                lim = tty_drain (lim);
 
             n -= ret;
             s += ret;
         }
 
         if (FD_ISSET (cmdfd, &rfd))
-            lim = tty_read ();
+            lim = tty_drain (lim);
     }
     return;
 
@@ -1394,6 +1672,21 @@ write_error:
     /* NOP */
 }
 
+/* the output is parsed while the input waits: the writes follow it */
+uint
+tty_drain (uint lim)
+{
+#ifdef FEATURE_TTY_THREAD
+    int ret;
+
+    /* the end of file is left to the main loop */
+    ret = tty_parse ();
+    return ret > 0 ? (uint) ret : lim;
+#else
+    return tty_read ();
+#endif  /* FEATURE_TTY_THREAD */
+}
+
 void
 tty_resize (int tw, int th)
 {
@@ -1458,6 +1751,8 @@ t_set_dirt (uint top, uint bottom)
           i <= bottom;
           i++, dirty++ )
         *dirty = True;
+
+    term.flags |= TERM_DIRTY;
 }
 
 void
@@ -1470,9 +1765,65 @@ tattr_dirtset (int attr)
     for ( i = term.size.row, line = term.line, dirty = term.dirty;
           i != 0;
           i--, line++, dirty++ ) {
-        if ( tline_is_attr (*line, attr) )
+        if ( tline_is_attr (*line, attr) ) {
             *dirty = True;
+            term.flags |= TERM_DIRTY;
+        }
+    }
+}
+
+/*
+ * A palette change is redrawn with the next frame: the changes of a theme
+ * are coalesced and only the lines using the changed entries are drawn.
+ */
+void
+t_recolor (uint idx)
+{
+    /* the borders and the blank cells are drawn with the defaults */
+    if ( idx == DEFAULT_FG || idx == DEFAULT_BG || idx >= RECOLOR_MAX )
+        term.recolorall = True;
+    else {
+        term.recolor [idx >> 3] |= 1 << (idx & 7);
+        /* bold brightens 0-7 to 8-15 */
+        if ( BETWEEN (idx, 8, 15) )
+            term.recolor [(idx - 8) >> 3] |= 1 << ((idx - 8) & 7);
     }
+    term.flags |= TERM_DIRTY | TERM_RECOLOR;
+}
+
+void
+t_recolor_dirt (void)
+{
+    uint i, col;
+    Line *line;
+    TermGlyph *tg;
+    int *dirty;
+
+    term.flags &= ~TERM_RECOLOR;
+    if ( term.recolorall ) {
+        term.recolorall = False;
+        memset (term.recolor, 0, sizeof (term.recolor));
+        t_full_dirt ();
+        return;
+    }
+
+    for ( i = term.size.row, line = term.line, dirty = term.dirty;
+          i != 0;
+          i--, line++, dirty++ ) {
+        if ( *dirty )
+            continue;
+
+        for ( col = term.size.col, tg = *line; col != 0; col--, tg++ ) {
+            if ( (tg->fg < RECOLOR_MAX &&
+                  term.recolor [tg->fg >> 3] & (1 << (tg->fg & 7))) ||
+                 (tg->bg < RECOLOR_MAX &&
+                  term.recolor [tg->bg >> 3] & (1 << (tg->bg & 7))) ) {
+                *dirty = True;
+                break;
+            }
+        }
+    }
+    memset (term.recolor, 0, sizeof (term.recolor));
 }
 
 void
@@ -1482,6 +1833,8 @@ t_full_dirt (void)
 #ifdef FEATURE_SYNC_UPDATE    
     tty_sync_update_end ();
 #endif
+    /* everything is redrawn: drop the pending scroll */
+    term.blit.n = 0;
     t_set_dirt (0, term.size.row - 1);
 }
 
@@ -1594,6 +1947,27 @@ t_swap_screen (void)
  
     term.flags ^= MODE_ALTSCREEN;
 
+    if ( term_flag (MODE_ALTSCREEN) ) {
+        /* the drawn primary screen is kept while the alt screen is
+         * active; remember lines which are not drawn in it yet */
+        if ( term.blit.n != 0 )
+            t_set_dirt (term.blit.top, term.blit.bottom);
+        if ( term.oc.row < term.size.row )
+            term.dirty [term.oc.row] = True;
+
+        memcpy (term.savedirty, term.dirty, term.size.row * sizeof (int));
+        x_screen_save ();
+    } else if ( x_screen_restore () ) {
+        /* nothing has changed in the meantime: just one blit */
+#ifdef FEATURE_SYNC_UPDATE    
+        tty_sync_update_end ();
+#endif
+        term.blit.n = 0;
+        memcpy (term.dirty, term.savedirty, term.size.row * sizeof (int));
+        term.flags |= TERM_DIRTY;
+        return;
+    }
+
     t_full_dirt ();
 }
 
@@ -1602,22 +1976,30 @@ t_scroll_down (uint orig, uint n)
 {
     uint i;
     Line *line0, *line1;
+    int *dirty0, *dirty1;
     Line temp;
+    int temp_dirty;
 
     i = term.bottom - orig + 1;
     if ( n > i )
         n = i;
 
-    t_set_dirt  (orig, term.bottom - n);
     tregion_clear (0, term.bottom - n + 1, term.size.col - 1, term.bottom);
+    t_scroll_blit (orig, -n);
 
-    for ( i = orig + n, line0 = term.line + term.bottom, line1 = line0 - n;
+    for ( i = orig + n, line0 = term.line + term.bottom, line1 = line0 - n,
+              dirty0 = term.dirty + term.bottom, dirty1 = dirty0 - n;
           i <= term.bottom;
-          i++, line0--, line1-- ) {
+          i++, line0--, line1--, dirty0--, dirty1-- ) {
         /* swap */
         temp = *line0;
         *line0 = *line1;
         *line1 = temp;
+
+        /* dirtyness moves with the line */
+        temp_dirty = *dirty0;
+        *dirty0 = *dirty1;
+        *dirty1 = temp_dirty;
     }
 
     sel_scroll (orig, n);
@@ -1629,41 +2011,85 @@ t_scroll_up (uint orig, uint n)
     uint i;
     Line temp;
     Line *line0, *line1;
+    int *dirty0, *dirty1;
+    int temp_dirty;
 
     i = term.bottom - orig + 1;
     if ( n > i )
         n = i;
 
     tregion_clear (0, orig, term.size.col - 1, orig + n - 1);
-    t_set_dirt (orig + n, term.bottom);
+    t_scroll_blit (orig, n);
 
-    for ( i = orig + n, line0 = term.line + orig, line1 = line0 + n;
+    for ( i = orig + n, line0 = term.line + orig, line1 = line0 + n,
+              dirty0 = term.dirty + orig, dirty1 = dirty0 + n;
           i <= term.bottom;
-          i++, line0++, line1++ ) {
+          i++, line0++, line1++, dirty0++, dirty1++ ) {
         /* swap */
         temp = *line0;
         *line0 = *line1;
         *line1 = temp;
+
+        /* dirtyness moves with the line */
+        temp_dirty = *dirty0;
+        *dirty0 = *dirty1;
+        *dirty1 = temp_dirty;
     }
 
     sel_scroll (orig, -n);
 }
 
+/* Instead of redrawing every scrolled line the drawn screen is shifted
+ * with one blit in t_draw.  Lines keep their dirtyness while they are
+ * moving so only the exposed lines and the changed ones are redrawn. */
+void
+t_scroll_blit (uint orig, int n)
+{
+    ScrollBlit *blit;
+
+    blit = &term.blit;
+
+    /* the old cursor is drawn in the screen: it's moving with the line */
+    if ( term.oc.row < term.size.row )
+        term.dirty [term.oc.row] = True;
+    term.flags |= TERM_DIRTY;
+
+    if ( blit->n != 0 &&
+         (blit->top != orig || blit->bottom != term.bottom) ) {
+        /* another region is pending: redraw it instead of the blit */
+        t_set_dirt (blit->top, blit->bottom);
+        blit->n = 0;
+    }
+
+    if ( blit->n == 0 ) {
+        blit->top = orig;
+        blit->bottom = term.bottom;
+    }
+    blit->n += n;
+
+    /* the whole region is scrolled out: all lines are dirty already */
+    if ( (uint) abs (blit->n) > blit->bottom - blit->top )
+        blit->n = 0;
+}
+
 void
 sel_scroll (int orig, int n)
 {
     if ( term.sel.ob.col == UINT_MAX )
         return;
 
-    if (BETWEEN (term.sel.nb.row, orig, term.bottom) != BETWEEN (term.sel.ne.row, orig, term.bottom))
+    if (BETWEEN (term.sel.nb.row, orig, term.bottom) != BETWEEN (term.sel.ne.row, orig, term.bottom)) {
+        /* the highlighted lines are moved by the scroll blit */
+        t_set_dirt (orig, term.bottom);
         sel_clear ();
-    else if (BETWEEN (term.sel.nb.row, orig, term.bottom)) {
+    } else if (BETWEEN (term.sel.nb.row, orig, term.bottom)) {
         term.sel.ob.row += n;
         term.sel.oe.row += n;
         if ( term.sel.ob.row < term.top || term.sel.ob.row > term.bottom ||
-             term.sel.oe.row < term.top || term.sel.oe.row > term.bottom )
+             term.sel.oe.row < term.top || term.sel.oe.row > term.bottom ) {
+            t_set_dirt (orig, term.bottom);
             sel_clear ();
-        else
+        } else
             sel_normalize ();
     }
 }
@@ -1806,17 +2232,20 @@ t_set_char (Rune rune, uint col, uint row)
     } else if ( tg->attr & ATTR_WDUMMY ) {
         temp--;
         temp->rune = ' ';
+        temp->cluster = 0;
         temp->attr &= ~ATTR_WIDE;
     }
 
     /* copy cursor attributes */
     tg->rune = rune;
+    tg->cluster = 0;
     tg->attr = term.c.attr;
     tg->fg = term.c.fg;
     tg->bg = term.c.bg;
  
     /* the line is dirty */
     term.dirty [row] = True;
+    term.flags |= TERM_DIRTY;
 } 
 
 int
@@ -1829,11 +2258,12 @@ tline_clear (Line line, uint row, uint col1, uint col2, int sel)
         line->bg = term.c.bg;
         line->attr = 0;
         line->rune = ' ';
+        line->cluster = 0;
     }
 
     /* selection */
     if ( sel &&
-         tline_sel_get_margin (row, &cmin, &cmax) &&
+         tregion_sel_margin (&term, row, &cmin, &cmax) &&
          cmin < col2 &&
          cmax > col1 ) {
         /* clear selection */
@@ -1876,9 +2306,10 @@ tregion_clear (uint col1, uint row1, uint col2, uint row2)
         row2 = term.size.row - 1;
 
     /* selection */
-    temp = tregion_is_sel ();
+    temp = tregion_is_sel (&term);
 
     /* clear */
+    term.flags |= TERM_DIRTY;
     for ( dirty = term.dirty + row1, line = term.line + row1;
           row1 <= row2;
           row1++, dirty++, line++ ) {
@@ -2877,7 +3308,7 @@ osc_handle (void)
             else if ( !x_color_set_name (DEFAULT_FG, arg1) )
                 error ("OSC: invalid foreground color: %s", arg1);
             else
-                t_draw (True);
+                t_recolor (DEFAULT_FG);
             return True;
 
         case 11:  /* background set */
@@ -2886,7 +3317,7 @@ osc_handle (void)
             else if ( !x_color_set_name (DEFAULT_BG, arg1) )
                 error ("OSC: invalid background color: %s", arg1);
             else
-                t_draw (True);
+                t_recolor (DEFAULT_BG);
             return True;
 
         case 12:  /* cursor color */
@@ -2895,7 +3326,7 @@ osc_handle (void)
             else if ( !x_color_set_name (DEFAULT_CS, arg1) )
                 error ("OSC: invalid cursor color: %s", arg1);
             else
-                t_draw (True);
+                t_recolor (DEFAULT_CS);
             return True;
 
 #ifdef ALLOW_WINDOW_OPS
@@ -2917,9 +3348,7 @@ osc_handle (void)
             if ( !x_color_set_name (num0, NULL) )
                 error ("OSC: invalid color: idx=%d", num0);
             else
-                /* TODO: if defaultbg color is changed, borders are
-                 * dirty */
-                t_draw (True);
+                t_recolor (num0);
             return True;
     }
 
@@ -2938,9 +3367,7 @@ osc_handle (void)
             else if ( !x_color_set_name (num0, arg2) )
                  error ("OSC: invalid color: idx=%d, name=%s", num0, arg2);
             else
-                 /* TODO: if defaultbg color is changed, borders are
-                  * dirty */
-                 t_draw (True);
+                 t_recolor (num0);
             return True;
     }
     return False;
@@ -3157,12 +3584,12 @@ tsel_dump (void)
 void
 tline_verbose (Line line)
 {
-    char buf [UTF_SIZ];
+    char buf [UTF_SIZ * (1 + CLUSTER_MARKS)];
     uint count, ret;
 
     count = tline_len (line);
     while ( count-- != 0 ) {
-        ret = utf8_encode (line->rune, buf);
+        ret = t_glyph_encode (line, buf);
         buf [ret] = '\0';
         verbose_s (buf);
         line++;
@@ -3186,14 +3613,14 @@ tregion_verbose (void)
 void
 tline_dump (Line line)
 {
-    char buf [UTF_SIZ];
+    char buf [UTF_SIZ * (1 + CLUSTER_MARKS)];
     uint count, ret;
 
     /* tline_len returns value between 0 and term.size.col */
     count = tline_len (line);
-    if ( count != 1 || line->rune != ' ' ) {
+    if ( count != 1 || line->rune != ' ' || line->cluster != 0 ) {
         while ( count-- != 0 ) {
-            ret = utf8_encode (line->rune, buf);
+            ret = t_glyph_encode (line, buf);
             t_printer (buf, ret);
             line++;
         }
@@ -3711,7 +4138,13 @@ check_control_code:
         return;
     }
 
-    if ( t_selected (term.c.p.col, term.c.p.row) )
+    /* combining marks join the cluster of the previous cell */
+    if ( width == 0 ) {
+        t_cluster_add (rune);
+        return;
+    }
+
+    if ( tregion_selected (&term, term.c.p.col, term.c.p.row) )
         sel_clear ();
 
     tg = term.line [term.c.p.row] + term.c.p.col;
@@ -3738,6 +4171,7 @@ check_control_code:
             /* we don't use $tp anymore */
             tg++;
             tg->rune = '\0';
+            tg->cluster = 0;
             tg->attr = ATTR_WDUMMY;
         }
     }
@@ -3748,6 +4182,93 @@ check_control_code:
         term.flags |= CURSOR_WRAPNEXT;
 }
 
+/*
+ * The base of the cluster is the cell before the cursor, the one under it
+ * if the next rune wraps.  A mark at the start of a line has no base and
+ * is dropped like the ones over CLUSTER_MARKS.
+ */
+void
+t_cluster_add (Rune rune)
+{
+    Rune marks [CLUSTER_MARKS];
+    const Rune *old;
+    TermGlyph *tg;
+    uint col, n;
+    ushort idx;
+
+    col = term.c.p.col;
+    if ( !term_flag (CURSOR_WRAPNEXT) ) {
+        if ( col == 0 )
+            return;
+        col--;
+    }
+
+    tg = term.line [term.c.p.row] + col;
+    if ( tg->attr & ATTR_WDUMMY ) {
+        col--;
+        tg--;
+    }
+
+    n = 0;
+    if ( tg->cluster != 0 ) {
+        old = cluster_get (tg->cluster, &n);
+        if ( n == CLUSTER_MARKS )
+            return;
+        memcpy (marks, old, n * sizeof (Rune));
+    }
+    marks [n++] = rune;
+
+    /* the clusters are drawn from the window's side */
+    tty_x_lock ();
+    idx = cluster_intern (marks, n);
+    if ( idx == 0 && t_clusters_sweep () != 0 )
+        idx = cluster_intern (marks, n);
+    tty_x_unlock ();
+    if ( idx == 0 )
+        return;
+
+    if ( tregion_selected (&term, col, term.c.p.row) )
+        sel_clear ();
+
+    tg->cluster = idx;
+    term.dirty [term.c.p.row] = True;
+    term.flags |= TERM_DIRTY;
+}
+
+/* frees the clusters no cell of either screen refers to */
+uint
+t_clusters_sweep (void)
+{
+    byte used [CLUSTER_MAX];
+    Line *l;
+    TermGlyph *tg, *end;
+    uint i, s;
+
+    memset (used, 0, cluster_count ());
+    for ( s = 0; s < 2; s++ ) {
+        for ( i = term.size.row, l = s == 0 ? term.line : term.alt; i != 0; i--, l++ ) {
+            for ( tg = *l, end = tg + term.size.col; tg != end; tg++ )
+                used [tg->cluster] = True;
+        }
+    }
+    return cluster_sweep (used);
+}
+
+/* the base rune and the marks of the cell; returns the length */
+uint
+t_glyph_encode (const TermGlyph *tg, char *s)
+{
+    const Rune *marks;
+    uint len, n;
+
+    len = utf8_encode (tg->rune, s);
+    if ( tg->cluster != 0 ) {
+        for ( marks = cluster_get (tg->cluster, &n); n != 0; n--, marks++ )
+            len += utf8_encode (*marks, s + len);
+    }
+    return len;
+}
+
 uint
 t_write (const char *buf, uint buflen, int show_ctrl)
 {
@@ -3820,11 +4341,23 @@ t_free (void)
     free (term.line);
     free (term.alt);
     free (term.dirty);
+    free (term.savedirty);
     free (term.tabs);
 
+#ifdef FEATURE_TTY_THREAD
+    /* snapshot */
+    if ( snap.line != NULL )
+        free (snap.line [0]);
+    free (snap.line);
+    free (snap.dirty);
+#endif  /* FEATURE_TTY_THREAD */
+
     /* strseq */
     thunk_free (&strescseq.t);
 
+    /* grapheme clusters */
+    cluster_free ();
+
     /* fd */
     close (iofd);
 }
@@ -3871,6 +4404,7 @@ t_resize (uint col, uint row)
     term.line  = x_realloc (term.line,  row * sizeof (Line));
     term.alt   = x_realloc (term.alt,   row * sizeof (Line));
     term.dirty = x_realloc (term.dirty, row * sizeof (int));
+    term.savedirty = x_realloc (term.savedirty, row * sizeof (int));
     term.tabs  = x_realloc (term.tabs,  col * sizeof (int));
 
     /* resize each row to new width, zero-pad if needed */
@@ -3930,6 +4464,9 @@ t_resize (uint col, uint row)
     }
 
     memcpy (&term.c, &c, sizeof (TermCursor));
+
+    /* the lines are drawn again in the new size */
+    t_full_dirt ();
 }
 
 void
@@ -3940,9 +4477,9 @@ tregion_draw (uint col1, uint row1, uint col2, uint row2)
     Line *line;
 
     /* selection */
-    sel = tregion_is_sel ();
+    sel = tregion_is_sel (&view);
 
-    for (dirty = term.dirty + row1, line = term.line + row1;
+    for (dirty = view.dirty + row1, line = view.line + row1;
          row1 < row2;
          row1++, dirty++, line++) {
         if ( !*dirty )
@@ -3954,11 +4491,104 @@ tregion_draw (uint col1, uint row1, uint col2, uint row2)
     }
 }
 
+int
+t_is_dirty (void)
+{
+    return term_flag (TERM_DIRTY);
+}
+
+/*
+ * $used [i] is set if colour $base + i is referenced by a cell of either
+ * screen, the cursor or a saved cursor.
+ */
+void
+t_colors_mark (byte *used, uint base, uint n)
+{
+    Line *l;
+    TermGlyph *tg, *end;
+    uint i, s;
+
+    for ( s = 0; s < 2; s++ ) {
+        for ( i = term.size.row, l = s == 0 ? term.line : term.alt; i != 0; i--, l++ ) {
+            for ( tg = *l, end = tg + term.size.col; tg != end; tg++ ) {
+                if ( tg->fg - base < n )
+                    used [tg->fg - base] = True;
+                if ( tg->bg - base < n )
+                    used [tg->bg - base] = True;
+            }
+        }
+    }
+
+    if ( term.c.fg - base < n )
+        used [term.c.fg - base] = True;
+    if ( term.c.bg - base < n )
+        used [term.c.bg - base] = True;
+
+    for ( s = 0; s < LEN (term.cstack); s++ ) {
+        if ( (uint) term.cstack [s].fg - base < n )
+            used [term.cstack [s].fg - base] = True;
+        if ( (uint) term.cstack [s].bg - base < n )
+            used [term.cstack [s].bg - base] = True;
+    }
+}
+
+#ifdef FEATURE_TTY_THREAD
+/*
+ * The rows the parser changed since the last frame are copied for t_draw,
+ * with those the pending blit moves and the cursor, the selection and the
+ * flags: the frame is drawn from them without the terminal.  The cursor
+ * drawn (the old one of the snapshot) is kept.
+ */
+void
+t_snapshot (void)
+{
+    uint i, all;
+
+    all = snap.size.col != term.size.col ||
+          snap.size.row != term.size.row ||
+          (snap.flags & MODE_ALTSCREEN) != (term.flags & MODE_ALTSCREEN);
+
+    if ( snap.size.col != term.size.col ||
+         snap.size.row != term.size.row ) {
+        if ( snap.line != NULL )
+            free (snap.line [0]);
+        snap.line  = x_realloc (snap.line,  term.size.row * sizeof (Line));
+        snap.dirty = x_realloc (snap.dirty, term.size.row * sizeof (int));
+        snap.line [0] = x_malloc (term.size.row * term.size.col * sizeof (TermGlyph));
+        for ( i = 1; i < term.size.row; i++ )
+            snap.line [i] = snap.line [0] + i * term.size.col;
+        snap.size = term.size;
+    }
+
+    for ( i = 0; i < term.size.row; i++ ) {
+        if ( all || term.dirty [i] ||
+             (term.blit.n != 0 && BETWEEN (i, term.blit.top, term.blit.bottom)) )
+            memcpy (snap.line [i], term.line [i], term.size.col * sizeof (TermGlyph));
+        snap.dirty [i] = term.dirty [i];
+        term.dirty [i] = False;
+    }
+
+    snap.c = term.c;
+    snap.blit = term.blit;
+    term.blit.n = 0;
+    snap.flags = term.flags;
+    term.flags &= ~TERM_DIRTY;
+    snap.sel = term.sel;
+
+    /* the cursor drawn by this frame */
+    term.oc = term.c.p;
+}
+#endif  /* FEATURE_TTY_THREAD */
+
 void
 t_draw (int fulldirt)
 {
     uint col, prev_col, prev_row;
     Line prev_tg, tg;
+#ifdef FEATURE_HARFBUZZ
+    uint col1, col2;
+    int sel;
+#endif  /* FEATURE_HARFBUZZ */
 
     if ( fulldirt )
         t_full_dirt ();
@@ -3966,45 +4596,90 @@ t_draw (int fulldirt)
     if ( !x_is_mode_visible () )
         return;
 
+    /* palette changes since the last frame */
+    if ( term_flag (TERM_RECOLOR) )
+        t_recolor_dirt ();
+
+#ifdef FEATURE_TTY_THREAD
+    /* the parser goes on while the frame is drawn */
+    t_snapshot ();
+    pthread_mutex_unlock (&tt.term);
+#endif  /* FEATURE_TTY_THREAD */
+
 //    info ("page: ");
 //    tregion_verbose ();
     
     /* remember old valuse */
-    prev_col = term.oc.col;
-    prev_row = term.oc.row;
+    prev_col = view.oc.col;
+    prev_row = view.oc.row;
  
     /* adjust cursor position */
-    if ( term.oc.col >= term.size.col )
-        term.oc.col = term.size.col - 1;
-    if ( term.oc.row >= term.size.row )
-        term.oc.row = term.size.row - 1;
+    if ( view.oc.col >= view.size.col )
+        view.oc.col = view.size.col - 1;
+    if ( view.oc.row >= view.size.row )
+        view.oc.row = view.size.row - 1;
     
-    prev_tg = term.line [term.oc.row] + term.oc.col;
+    prev_tg = view.line [view.oc.row] + view.oc.col;
     if ( prev_tg->attr & ATTR_WDUMMY ) {
-        term.oc.col--;
+        view.oc.col--;
         prev_tg--;
     }
     
-    col = term.c.p.col;
-    tg = term.line [term.c.p.row] + col;
+    col = view.c.p.col;
+    tg = view.line [view.c.p.row] + col;
     if ( tg->attr & ATTR_WDUMMY ) {
         col--;
         tg--;
     }
     
-    /* draw */
-    tregion_draw (0, 0, term.size.col, term.size.row);
+#ifdef FEATURE_HARFBUZZ
+    /* the cursor cell is shaped alone */
+    x_glyph_shape_break (col, view.c.p.row);
+#endif  /* FEATURE_HARFBUZZ */
+
+    /* the cursor is the only change: don't walk the lines */
+    if ( view.flags & TERM_DIRTY ) {
+        /* shift the drawn lines first */
+        if ( view.blit.n != 0 ) {
+            x_scroll (view.blit.top, view.blit.bottom, view.blit.n);
+            view.blit.n = 0;
+        }
+
+        /* draw */
+        tregion_draw (0, 0, view.size.col, view.size.row);
+        view.flags &= ~TERM_DIRTY;
+    }
+
+#ifdef FEATURE_HARFBUZZ
+    /* the ligature the cursor leaves is joined again and the one it enters
+     * broken: only their cells are redrawn */
+    if ( prev_tg != tg ) {
+        sel = tregion_is_sel (&view);
+        if ( x_glyph_shape_extent (view.line [view.oc.row], view.oc.col, &col1, &col2) ) {
+            x_line_draw (view.line [view.oc.row], view.oc.row, col1, col2, sel);
+            prev_tg = NULL;
+        }
+        if ( x_glyph_shape_extent (view.line [view.c.p.row], col, &col1, &col2) )
+            x_line_draw (view.line [view.c.p.row], view.c.p.row, col1, col2, sel);
+    }
+#endif  /* FEATURE_HARFBUZZ */
 
     /* remove old cursor and draw new one */
-    x_cursor_remove (prev_tg, term.oc.col, term.oc.row);
-    x_cursor_draw (tg->rune, tg->attr, col, term.c.p.row);
+    x_cursor_remove (prev_tg, view.oc.col, view.oc.row);
+    x_cursor_draw (tg, col, view.c.p.row);
     
-    term.oc.col = col;
-    term.oc.row = term.c.p.row;
+    view.oc.col = col;
+    view.oc.row = view.c.p.row;
 
     x_draw_finish ();
     
-    if ( prev_col != term.oc.col ||
-         prev_row != term.oc.row )
-        x_im_spot (term.oc.col, term.oc.row);
+    if ( prev_col != view.oc.col ||
+         prev_row != view.oc.row )
+        x_im_spot (view.oc.col, view.oc.row);
+
+#ifdef FEATURE_TTY_THREAD
+    /* the window is let go first: the terminal comes before it */
+    pthread_mutex_unlock (&tt.x);
+    tty_lock ();
+#endif  /* FEATURE_TTY_THREAD */
 }
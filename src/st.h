@@ -64,7 +64,11 @@ typedef enum {
     SEL_ALTSCREEN   = 1 << 19,
 
     /* CSI esc seq: set/reset in csi_parse */
-    CSI_PRIV        = 1 << 20
+    CSI_PRIV        = 1 << 20,
+
+    /* draw state: set with dirty lines, reset in t_draw */
+    TERM_DIRTY      = 1 << 21,
+    TERM_RECOLOR    = 1 << 22   /* palette entries changed */
 } TermFlags;
 
 typedef enum {
@@ -90,6 +94,7 @@ typedef struct {
 	ushort attr;  /* attribute flags */
 	ushort fg;    /* foreground color; cache index */
     ushort bg;    /* background color; cache index */
+    ushort cluster;  /* combining marks; cluster index, 0: none */
 } TermGlyph;
 
 typedef TermGlyph *Line;
@@ -113,9 +118,23 @@ int tty_new (const char **argv, uint argn);
 uint tty_read (void);
 void tty_resize (int, int);
 void tty_write (const char *, uint, int);
+#ifdef FEATURE_TTY_THREAD
+void tty_lock (void);
+void tty_unlock (void);
+void tty_x_lock (void);
+void tty_x_unlock (void);
+#else
+#define tty_lock()
+#define tty_unlock()
+#define tty_x_lock()
+#define tty_x_unlock()
+#endif  /* FEATURE_TTY_THREAD */
 
 /* terminal */
 void t_draw (int fulldirt);
+int t_is_dirty (void);
+void t_colors_mark (byte *used, uint base, uint n);
+void t_recolor (uint idx);
 int t_attr_set (GlyphAttribute);
 void t_new (uint, uint);
 void t_resize (uint, uint);
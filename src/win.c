@@ -19,6 +19,18 @@
 
 #include "def.h"
 #include "args.h"
+#include "boxdraw.h"
+#include "cluster.h"
+#include "fccache.h"
+#ifdef FEATURE_GLYPHSET
+#include "glyphset.h"
+#endif  /* FEATURE_GLYPHSET */
+#ifdef FEATURE_HARFBUZZ
+#include "shape.h"
+#endif  /* FEATURE_HARFBUZZ */
+#ifdef FEATURE_SHM
+#include "soft.h"
+#endif  /* FEATURE_SHM */
 #include "thunk.h"
 #include "strutil.h"
 #include "verbose.h"
@@ -41,6 +53,33 @@
 #define TRUEGREEN(x)   ((x) & 0x00ff00)
 #define TRUEBLUE(x)   (((x) & 0x0000ff) << 8)
 
+/* damaged rectangles copied to the window; a full copy is used when
+ * there are more of them or they cover half of the window */
+#define DAMAGE_MAX  32
+
+/* glyph index cache: runes below GLYPH_FLAT are indexed directly, the
+ * others share GLYPH_SLOTS direct-mapped slots (a power of 2) */
+#define GLYPH_FLAT   0x2600
+#define GLYPH_SLOTS  1024
+#define GLYPH_STYLES 4
+
+/* fallback index: open addressing, doubled when 3/4 full */
+#define FALLBACK_INIT  256
+#define FALLBACK_FACES (FALLBACK_MEMORY / FALLBACK_FACE_MEMORY)
+
+/* a blank cell has no glyph: only its background is drawn */
+#define GLYPH_BLANK(g)  ((g)->rune == ' ' && (g)->cluster == 0)
+
+/* glyph specs of a line cell: the base rune and the marks of its cluster */
+#define GLYPH_SPECS_MAX  (1 + CLUSTER_MARKS)
+
+/* box drawing glyphs cached per rune and colours (a power of 2) */
+#define BOX_SLOTS  256
+
+/* zoom font sets; Xft's default glyph memory of a primary font */
+#define FONTSET_MAX        4
+#define FONT_GLYPH_MEMORY  (1024 * 1024)
+
 #define FONT_MASK  (FontRegularBadSlant | FontRegularBadWeight | \
     FontItalicBadSlant | FontItalicBadWeight | FontBoldItalicBadSlant |\
     FontBoldItalicBadWeight | FontBoldBadSlant | FontBoldBadWeight)
@@ -94,6 +133,7 @@ typedef struct {
     Display *dpy;
     Cursor cursor;
     Drawable buf;
+    Drawable savebuf;        /* primary screen while the alt one is active */
     Draw draw;
     Window tw;
     struct {
@@ -107,8 +147,25 @@ typedef struct {
     int gm;                  /* geometry mask */
     Colormap cmap;
     GlyphFontSpec *specbuf;  /* font spec buffer used for rendering */
+    GlyphFontSpec *shapebuf; /* specs of the shaped runs (FEATURE_HARFBUZZ) */
+    Rune *shaperunes;        /* runes of a shaped sequence */
+    uint shapecol, shaperow; /* the cursor cell, shaped alone */
+    struct {
+        XRectangle rects [DAMAGE_MAX];
+        uint n;
+        uint area;
+        int full;            /* copy the whole buffer */
+    } damage;                /* buffer regions changed in the frame */
+    int stale;               /* buffer doesn't hold the drawn screen */
+    int saved;               /* savebuf holds the primary screen */
+    int soft;                /* the client draws the buffer (FEATURE_SHM) */
     Atom xembed, wmdeletewin, netwmname, netwmiconname, netwmpid;
     Visual *vis;
+    struct {
+        int local;           /* TrueColor: pixels are computed here */
+        int shift [3], len [3];
+        ulong alpha;         /* opaque alpha bits of a 32 bit visual */
+    } pixel;
     XSetWindowAttributes attrs;
 } XWindow;
 
@@ -125,6 +182,7 @@ typedef struct {
     XftFont *match;
     FcFontSet *set;
     FcPattern *pattern;
+    uint key;           /* of the fallback disk cache */
     int height;
     int width;
     int ascent;
@@ -142,18 +200,139 @@ typedef enum {
 } FontcacheFlags;
 
 typedef struct {
-    XftFont *font;
+    XftFont *font;          /* NULL: free slot */
+    const FcChar8 *file;    /* face: owned by $font */
+    int index;
+    ulong used;             /* frame of the last use */
     byte flags;
     Rune unicodep;
 } Fontcache;
 
+/* Fallback Font Index */
+typedef struct {
+    Rune rune;
+    int font;       /* index into dc.fntcache; -1: empty slot */
+    FT_UInt glyph;
+    byte flags;
+} FallbackIndex;
+
+typedef struct {
+    FallbackIndex *slots;
+    uint size;      /* power of 2 */
+    uint count;
+} FallbackHash;
+
+/* Glyph Index Cache */
+typedef struct {
+    XftFont *font;  /* NULL: empty entry */
+    FT_UInt glyph;
+    Rune rune;      /* key of the direct-mapped slot */
+    int face;       /* index into dc.fntcache; -1: a primary font */
+} GlyphIndex;
+
+typedef struct {
+    GlyphIndex *flat [GLYPH_STYLES];  /* allocated on the first use */
+    GlyphIndex slots [GLYPH_STYLES][GLYPH_SLOTS];
+    ulong hits;
+    ulong misses;
+} GlyphCache;
+
+/* Frame Batch: the draw requests of a frame grouped by colour */
+typedef struct {
+    uint color;         /* index into dc.clrcache */
+    XRectangle r;
+} FrameRect;
+
+typedef struct {
+    uint color;
+    uint clip;          /* 1 + index into the clips; 0: the glyph fits its cell */
+    XftGlyphFontSpec spec;
+} FrameGlyph;
+
+typedef struct {
+    Rune rune;
+    short x, y;
+    uint fg, bg;
+} FrameBox;
+
+typedef struct {
+    Thunk fills;        /* FrameRect: backgrounds and borders */
+    Thunk boxes;        /* FrameBox */
+    Thunk glyphs;       /* FrameGlyph */
+    Thunk clips;        /* XRectangle: one per run with clipped glyphs */
+    Thunk decors;       /* FrameRect: underlines and strikethroughs */
+    Thunk rects;        /* XRectangle: flush buffers */
+    Thunk specs;        /* XftGlyphFontSpec */
+    ulong cells;        /* line cells drawn */
+    ulong made;         /* glyph specs made for them */
+} FrameBatch;
+
+/* True Colours: dc.clrcache entries from TRUECOLOR_BASE on */
+typedef struct {
+    uint rgb;           /* 0xRRGGBB as requested */
+    ushort index;       /* into dc.clrcache; 0: empty slot */
+} TrueColorSlot;
+
+typedef struct {
+    TrueColorSlot slots [TRUECOLOR_MAX * 2];
+    uint rgb [TRUECOLOR_MAX];  /* key of the entries */
+    ushort faint [TRUECOLOR_MAX];    /* index of the faint variant, 0: none */
+    ushort reverse [TRUECOLOR_MAX];  /* of the reverse video one */
+    Thunk free;         /* uint: entries freed by the sweep */
+    ulong loaded;
+    ulong swept;
+} TrueColors;
+
+/* Box Drawing Cache */
+typedef struct {
+    Rune rune;
+    ulong fg;
+    ulong bg;
+    Pixmap pm;          /* None: empty slot */
+} BoxGlyph;
+
+typedef struct {
+    BoxGlyph slots [BOX_SLOTS];
+    int cw, ch;         /* cell size of the pixmaps */
+    XRectangle *rects;  /* boxdraw_rects buffer for that size */
+} BoxCache;
+
+/* Fonts of one zoom size */
+typedef struct {
+    TermFont rfont, bfont, ifont, ibfont;
+    FcPattern *pattern;
+    Thunk fntcache;
+    FallbackHash fallback;
+    uint open;          /* open fallback fonts */
+    double size;        /* 0: free slot */
+    int cw, ch;
+    uint flags;         /* FONT_MASK bits of tw.flags */
+    ulong used;
+} FontSet;
+
 /* Dratwg Context */
 typedef struct {
     Thunk clrcache;
+    TrueColors truecolor;
     Thunk fntcache;
+    FallbackHash fallback;
+    GlyphCache glyphcache;
+    struct {
+        uint open;
+        ulong opened;
+        ulong shared;
+        ulong evicted;
+    } faces;
+    ulong frame;
     TermFont rfont, bfont, ifont, ibfont;
+    FcPattern *pattern;  /* the bold/italic variants are loaded from it */
     double usedfontsize;
     double defaultfontsize;
+    FontSet fontsets [FONTSET_MAX];  /* of the previous zoom sizes */
+    BoxCache boxcache;
+    FrameBatch batch;
+    uint prewarm;        /* next glyph of x_prewarm */
+    ulong fontsetclock;
     GC gc;
 } DC;
 
@@ -171,20 +350,55 @@ static void ttysend (const Arg *);
 static int x_set_title_atom (const char *p, XTextProperty *prop, Atom atom);
 static char * x_get_title_atom (Atom atom);
 
-static inline ushort sixd_to_16bit (uint val);
+static void x_visual_init (void);
 
 /* glyph */
+static void x_glyphcache_clear (void);
+static void x_glyphcache_free (void);
+static GlyphIndex * x_glyphcache_lookup (Rune rune, FontcacheFlags flags);
 static TermFont * x_glyph_attr_to_font (GlyphAttribute attr, FontcacheFlags *retflags);
 static TermFont * x_glyph_make_font_spec (XftGlyphFontSpec *ps, Rune rune, GlyphAttribute attr, TermFont *font, FontcacheFlags *retflags);
 static int x_glyph_make_font_specs (XftGlyphFontSpec *, const TermGlyph *, int, int, int);
-static void x_glyph_draw_font_specs (const XftGlyphFontSpec *, uint, uint, uint, GlyphAttribute, uint, uint);
-static void x_glyph_draw (Rune rune, uint col, uint row, GlyphAttribute attr, uint fg, uint bg);
+static uint x_glyph_nspecs (const TermGlyph *);
+static void x_line_draw_run (const XftGlyphFontSpec *, uint, uint, const TermGlyph *, uint, uint, uint, GlyphAttribute, uint, uint);
+#ifdef FEATURE_HARFBUZZ
+static const XftGlyphFontSpec * x_glyph_shape (const XftGlyphFontSpec *, uint *, const TermGlyph *, uint, uint, uint);
+static XftGlyphFontSpec * x_glyph_shape_seq (XftGlyphFontSpec *, const XftGlyphFontSpec *, uint, XftFont *);
+static int x_glyph_shape_joins (const TermGlyph *, const TermGlyph *, TermFont *, FontcacheFlags *);
+static const ShapedGlyph * x_glyph_shape_part (XftFont *, const Rune *, uint, uint *, ShapedGlyph *);
+#endif  /* FEATURE_HARFBUZZ */
+static void x_glyph_draw_font_specs (const XftGlyphFontSpec *, uint, uint, uint, uint, GlyphAttribute, uint, uint, int);
+static void x_glyph_draw (const TermGlyph *tg, uint col, uint row, GlyphAttribute attr, uint fg, uint bg);
+static BoxGlyph * x_box_pixmap (Rune rune, Color *fg, Color *bg);
+static XRectangle * x_box_rects (void);
+static void x_box_draw (Rune rune, int x, int y, Color *fg, Color *bg);
+static void x_boxcache_free (void);
+
+/* frame batch */
+static void x_frame_init (void);
+static void x_frame_free (void);
+static void x_frame_fill (Thunk *list, uint color, int x1, int y1, int x2, int y2);
+static int x_frame_cmp_rect (const void *a, const void *b);
+static int x_frame_cmp_glyph (const void *a, const void *b);
+static void x_frame_flush_rects (Thunk *list);
+static void x_frame_flush (void);
 
 /* cursor */
 static void x_cursor_draw_inactive (Color *drawcol, uint col, uint row);
 static int x_cursor_draw_non_glyph (Color *drawcol, uint col, uint row);
 
 static void x_clear (uint, uint, uint, uint);
+static void x_damage_add (int x, int y, int width, int height);
+static void x_damage_full (void);
+static void x_buf_stale (void);
+static void x_buf_create (void);
+static void x_buf_fill (ulong, int, int, uint, uint);
+static void x_buf_fill_rects (ulong, XRectangle *, uint);
+static void x_buf_glyphs (Color *, const XftGlyphFontSpec *, int, const XRectangle *);
+static void x_buf_put (int, int, uint, uint);
+static void x_buf_sync (void);
+static void x_buf_prewarm (const XftGlyphFontSpec *);
+static int x_prewarm (void);
 static int x_geommask_to_gravity (int);
 static int x_im_open (Display *);
 static void x_im_instantiate (Display *, XPointer, XPointer);
@@ -202,15 +416,38 @@ static int x_color_load_xterm (uint index, Color *color);
 static int x_color_load_grey (uint index, Color *color);
 static int x_color_load_value (uint red, uint green, uint blue, Color *color);
 static int x_color_load_name (const char *name, Color *ret);
-static void x_colors_reverse (void);
-static int x_color_reverse (Color *c);
+static uint x_color_resolve (uint idx);
+static int x_color_load_dim (const Color *src, Color *dst);
+static int x_color_load_inverse (const Color *src, Color *dst);
+static void x_color_replace (uint idx, const Color *c);
+static uint x_color_sixd (uint v);
+static TrueColorSlot * x_truecolor_probe (uint rgb);
+static void x_truecolor_clear (void);
+static uint x_truecolor_sweep (void);
+static uint x_truecolor_cube (uint);
+static int x_truecolor_load (uint rgb, int sweep);
 
 /* fonts */
 static int x_font_load (TermFont *, FcPattern *);
 static void x_fonts_load (double);
+static TermFont * x_font_variant (TermFont *f, FontcacheFlags flags);
+static uint x_fontset_memory (const FontSet *fs);
+static void x_fontset_unload (FontSet *fs);
+static void x_fontset_save (void);
+static int x_fontset_restore (double size);
+static void x_fontsets_free (void);
+static void x_font_close (XftFont *);
 static void x_font_unload (TermFont *);
 static void x_fonts_unload (void);
-
+static FallbackIndex * fallback_probe (Rune rune, FontcacheFlags flags);
+static void fallback_set (Rune rune, FontcacheFlags flags, int font, FT_UInt glyph);
+static void fallback_clear (void);
+static void fontcache_evict (void);
+static Fontcache * fontcache_face (const FcChar8 *file, int index, FontcacheFlags flags);
+static FcPattern * fontcache_match_file (FcPattern *fcpattern, const char *file, int index);
+
+static void x_stats_verbose (void);
+static void x_stats_time (const char *what, struct timespec *since);
 static void x_set_env (void);
 static void x_set_urgency (int);
 static uint evcol (XEvent *);
@@ -250,6 +487,12 @@ static const char * get_prog_name (const char *name);
 
 #define MAX_INDEX_CACHE  (LEN (colornames) + 256)
 
+/* the palette, its faint variants, the reverse video of both and the true
+ * colours */
+#define FAINT_BASE       MAX_INDEX_CACHE
+#define REVERSE_BASE     (2 * MAX_INDEX_CACHE)
+#define TRUECOLOR_BASE   (4 * MAX_INDEX_CACHE)
+
 
 static EventHandler events [LASTEvent] = {
     [KeyPress]         = kpress,
@@ -338,8 +581,10 @@ zoom (const Arg *arg)
 void
 zoom_abs (const Arg *arg)
 {
-    x_fonts_unload ();
-    x_fonts_load (arg->f);
+    /* keep the fonts of this size open to zoom back */
+    x_fontset_save ();
+    if ( !x_fontset_restore (arg->f) )
+        x_fonts_load (arg->f);
     cresize (0, 0);
     t_draw (True);
     x_hints ();
@@ -623,7 +868,9 @@ selnotify (XEvent *e)
 void
 x_clip_copy (void)
 {
+    tty_x_lock ();
     clip_copy (NULL);
+    tty_x_unlock ();
 }
 /*
 void
@@ -701,7 +948,9 @@ sel_set (char *str, Time t)
 void
 x_set_sel (char *str)
 {
+    tty_x_lock ();
     sel_set (str, CurrentTime);
+    tty_x_unlock ();
 }
 
 void
@@ -756,19 +1005,34 @@ x_resize (uint col, uint row)
     tw.tw = col * tw.cw;
     tw.th = row * tw.ch;
 
-    XFreePixmap (xw.dpy, xw.buf);
-    xw.buf = XCreatePixmap (xw.dpy, xw.tw, tw.w, tw.h,
-                            DefaultDepth (xw.dpy, xw.scr));
-    XftDrawChange (xw.draw, xw.buf);
+    x_buf_create ();
     x_clear (0, 0, tw.w, tw.h);
+    x_damage_full ();
+    x_buf_stale ();
+
+    /* the saved screen has the old size */
+    if ( xw.savebuf != None ) {
+        XFreePixmap (xw.dpy, xw.savebuf);
+        xw.savebuf = None;
+    }
 
     /* resize to new width */
-    xw.specbuf = x_realloc (xw.specbuf, col * sizeof (GlyphFontSpec));
+    xw.specbuf = x_realloc (xw.specbuf, col * GLYPH_SPECS_MAX * sizeof (GlyphFontSpec));
+#ifdef FEATURE_HARFBUZZ
+    xw.shapebuf = x_realloc (xw.shapebuf, col * GLYPH_SPECS_MAX * sizeof (GlyphFontSpec));
+    xw.shaperunes = x_realloc (xw.shaperunes, col * sizeof (Rune));
+#endif  /* FEATURE_HARFBUZZ */
 }
 
 int
 x_color_load_name (const char *name, Color *ret)
 {
+    XColor xc;
+
+    /* "#rrggbb" and "rgb:" are parsed without the server */
+    if ( xw.pixel.local && XParseColor (xw.dpy, xw.cmap, name, &xc) )
+        return x_color_load_value (xc.red, xc.green, xc.blue, ret);
+
     if ( XftColorAllocName (xw.dpy, xw.vis, xw.cmap, name, ret) )
         return True;
 
@@ -776,6 +1040,39 @@ x_color_load_name (const char *name, Color *ret)
     return False;
 } 
 
+/*
+ * A TrueColor pixel is a function of the RGB values and the visual masks:
+ * the colours are made here without asking the server.
+ */
+void
+x_visual_init (void)
+{
+    const ulong masks [3] = { xw.vis->red_mask, xw.vis->green_mask, xw.vis->blue_mask };
+    ulong m;
+    int i;
+
+    xw.pixel.local = xw.vis->class == TrueColor;
+    if ( !xw.pixel.local )
+        return;
+
+    for ( i = 0; i < 3; i++ ) {
+        for ( m = masks [i], xw.pixel.shift [i] = 0; m != 0 && !(m & 1); m >>= 1 )
+            xw.pixel.shift [i]++;
+        for ( xw.pixel.len [i] = 0; m & 1; m >>= 1 )
+            xw.pixel.len [i]++;
+
+        /* Xft makes them */
+        if ( xw.pixel.len [i] == 0 || xw.pixel.len [i] > 16 ) {
+            xw.pixel.local = False;
+            return;
+        }
+    }
+
+    xw.pixel.alpha = 0;
+    if ( DefaultDepth (xw.dpy, xw.scr) == 32 )
+        xw.pixel.alpha = 0xffffffff & ~(masks [0] | masks [1] | masks [2]);
+}
+
 int
 x_color_load_value (uint red, uint green, uint blue, Color *color)
 {
@@ -786,6 +1083,15 @@ x_color_load_value (uint red, uint green, uint blue, Color *color)
     render.green = green;
     render.blue  = blue;
 
+    if ( xw.pixel.local ) {
+        color->color = render;
+        color->pixel = xw.pixel.alpha |
+            (ulong) (red   >> (16 - xw.pixel.len [0])) << xw.pixel.shift [0] |
+            (ulong) (green >> (16 - xw.pixel.len [1])) << xw.pixel.shift [1] |
+            (ulong) (blue  >> (16 - xw.pixel.len [2])) << xw.pixel.shift [2];
+        return True;
+    }
+
     if ( XftColorAllocValue (xw.dpy, xw.vis, xw.cmap, &render, color) )
         return True;
 
@@ -793,21 +1099,16 @@ x_color_load_value (uint red, uint green, uint blue, Color *color)
     return False;
 }
 
-ushort
-sixd_to_16bit (uint val)
-{
-    if ( val == 0 )
-        return 0;
-    return val * 0x2828 + 0x3737;
-}
-
 /* $index must be < 6*6*6 */
 int
 x_color_load_xterm (uint index, Color *color)
 {
-    return x_color_load_value (sixd_to_16bit ((index / 36) % 6),
-                               sixd_to_16bit ((index /  6) % 6),
-                               sixd_to_16bit ( index       % 6),
+    /* the levels of the xterm colour cube */
+    static const ushort sixd [6] = { 0x0000, 0x5f5f, 0x8787, 0xafaf, 0xd7d7, 0xffff };
+
+    return x_color_load_value (sixd [(index / 36) % 6],
+                               sixd [(index /  6) % 6],
+                               sixd [ index       % 6],
                                color);
 }
 
@@ -878,116 +1179,259 @@ x_clrcache_free (void)
     dc.clrcache.nelements = 0;
 }
 
-int
-x_color_reverse (Color *c)
+/* nearest level of the xterm colour cube: 0, 95, 135, 175, 215, 255 */
+uint
+x_color_sixd (uint v)
 {
-    Color new_c;
+    return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40;
+}
 
-    /* create reversed color */
-    if ( !x_color_load_value (~c->color.red,
-                              ~c->color.green,
-                              ~c->color.blue,
-                              &new_c) )
-        return False;
+TrueColorSlot *
+x_truecolor_probe (uint rgb)
+{
+    TrueColorSlot *ts;
+    uint i;
 
-    /* free current color */
-    XftColorFree (xw.dpy, xw.vis, xw.cmap, c);
- 
-    /* and set new one */
-    memcpy (c, &new_c, sizeof (Color));
-    return True;
+    /* the table is never more than half full */
+    for ( i = (rgb * 0x9e3779b1) >> 16; ; i++ ) {
+        ts = dc.truecolor.slots + (i & (LEN (dc.truecolor.slots) - 1));
+        if ( ts->index == 0 || ts->rgb == rgb )
+            return ts;
+    }
 }
 
 void
-x_colors_reverse (void)
+x_truecolor_clear (void)
 {
-    Color *c, *fg;
-    Color swap;
-    int idx_save, idx_swap, idx_cur;
-   
-    if ( DEFAULT_FG < DEFAULT_BG ) {
-        idx_save = DEFAULT_BG;
-        idx_swap = DEFAULT_FG;
-    } else {
-        idx_save = DEFAULT_FG;
-        idx_swap = DEFAULT_BG;
-    }
-
-    /* revers all true colors */
-    for ( idx_cur = dc.clrcache.nelements, c = (Color *) dc.clrcache.items;
-          idx_cur != 0;
-          idx_cur--, c++ ) {
-        if ( idx_cur == idx_save ) {
-            /* copy the content to the temp */
-            memcpy (&swap, c, sizeof (Color));
-            /* remember the thunk */
-            fg = c;
-            continue;
-        }
+    memset (dc.truecolor.slots, 0, sizeof (dc.truecolor.slots));
+    memset (dc.truecolor.faint, 0, sizeof (dc.truecolor.faint));
+    memset (dc.truecolor.reverse, 0, sizeof (dc.truecolor.reverse));
+    dc.truecolor.free.nelements = 0;
+}
+
+/*
+ * Frees the true colours no cell refers to and rehashes the others.
+ */
+uint
+x_truecolor_sweep (void)
+{
+    TrueColors *tc = &dc.truecolor;
+    TrueColorSlot *ts;
+    byte used [TRUECOLOR_MAX];
+    Color *c;
+    uint i, n;
+
+    n = dc.clrcache.nelements - TRUECOLOR_BASE;
+    memset (used, 0, n);
+    t_colors_mark (used, TRUECOLOR_BASE, n);
+
+    /* the variants live as long as their colours (the faint ones first:
+     * they have reverse video ones too) */
+    for ( i = 0; i < n; i++ ) {
+        if ( used [i] && tc->faint [i] >= TRUECOLOR_BASE )
+            used [tc->faint [i] - TRUECOLOR_BASE] = True;
+    }
+    for ( i = 0; i < n; i++ ) {
+        if ( used [i] && tc->reverse [i] >= TRUECOLOR_BASE )
+            used [tc->reverse [i] - TRUECOLOR_BASE] = True;
+    }
 
-        if ( idx_cur == idx_swap ) {
-            /* swap colors */
-            memcpy (fg, c,     sizeof (Color));
-            memcpy (c,  &swap, sizeof (Color));
+    /* the slots are rehashed, the memos of the used colours kept */
+    memset (tc->slots, 0, sizeof (tc->slots));
+    tc->free.nelements = 0;
+    for ( i = 0, c = (Color *) dc.clrcache.items + TRUECOLOR_BASE; i < n; i++, c++ ) {
+        if ( used [i] ) {
+            ts = x_truecolor_probe (tc->rgb [i]);
+            ts->rgb = tc->rgb [i];
+            ts->index = TRUECOLOR_BASE + i;
             continue;
         }
 
-        if ( !x_color_reverse (c) )
-            break;
+        XftColorFree (xw.dpy, xw.vis, xw.cmap, c);
+        c->pixel = 0;
+        tc->faint [i] = 0;
+        tc->reverse [i] = 0;
+        *(uint *) thunk_alloc_next (&tc->free) = TRUECOLOR_BASE + i;
     }
+    tc->swept++;
+    return tc->free.nelements;
 }
 
+/*
+ * True colours are looked up by their RGB: a colour repeated by the
+ * application takes one entry.  $sweep allows to free the unreferenced
+ * ones when the entries are used up; it's False while a frame is drawn
+ * because the frame holds the indexes.
+ */
 int
-x_color_load_rgb (uint red, uint green, uint blue)
+x_truecolor_load (uint rgb, int sweep)
 {
-    Color *new_c;
-    uint ret;
+    TrueColors *tc = &dc.truecolor;
+    TrueColorSlot *ts;
+    Color new_c;
+    uint idx;
+
+    ts = x_truecolor_probe (rgb);
+    if ( ts->index != 0 )
+        return ts->index;
 
-    /* first allocate new thunk */
-    ret = dc.clrcache.nelements;
-    new_c = (Color *) thunk_alloc_next (&dc.clrcache);
+    /* a freed entry, a new one or the nearest xterm colour */
+    if ( tc->free.nelements == 0 &&
+         dc.clrcache.nelements == TRUECOLOR_BASE + TRUECOLOR_MAX ) {
+        if ( sweep && x_truecolor_sweep () != 0 )
+            return x_truecolor_load (rgb, False);
 
-    /* is reverse mode? */
-    if ( twin_flag (MODE_REVERSE) ) {
+        return x_truecolor_cube (rgb);
     }
 
     /* create new color */
     if ( !x_color_load_value (
-                red   << 8,
-                green << 8,
-                blue  << 8,
-                new_c) ) {
-        /* remove thunk */
-        dc.clrcache.nelements--;
+                (rgb >> 16) << 8,
+                (rgb & 0xff00),
+                (rgb & 0xff) << 8,
+                &new_c) )
         return -1;
+
+    if ( tc->free.nelements != 0 )
+        idx = ((uint *) tc->free.items) [--tc->free.nelements];
+    else {
+        idx = dc.clrcache.nelements;
+        thunk_alloc_next (&dc.clrcache);
     }
+    memcpy ((Color *) dc.clrcache.items + idx, &new_c, sizeof (Color));
+
+    ts->rgb = rgb;
+    ts->index = idx;
+    tc->rgb [idx - TRUECOLOR_BASE] = rgb;
+    tc->loaded++;
+    return idx;
+}
+
+/* the nearest colour of the xterm cube */
+uint
+x_truecolor_cube (uint rgb)
+{
+    return 16 + 36 * x_color_sixd (rgb >> 16) +
+                 6 * x_color_sixd ((rgb >> 8) & 0xff) +
+                     x_color_sixd (rgb & 0xff);
+}
 
+int
+x_color_load_rgb (uint red, uint green, uint blue)
+{
+    int ret;
+
+    tty_x_lock ();
+    ret = x_truecolor_load (red << 16 | green << 8 | blue, True);
+    tty_x_unlock ();
     return ret;
-} 
+}
+
+/* half the intensity */
+int
+x_color_load_dim (const Color *src, Color *dst)
+{
+    return x_color_load_value (src->color.red   >> 1,
+                               src->color.green >> 1,
+                               src->color.blue  >> 1,
+                               dst);
+}
+
+int
+x_color_load_inverse (const Color *src, Color *dst)
+{
+    return x_color_load_value (~src->color.red   & 0xffff,
+                               ~src->color.green & 0xffff,
+                               ~src->color.blue  & 0xffff,
+                               dst);
+}
+
+/* replaces the entry $idx */
+void
+x_color_replace (uint idx, const Color *c)
+{
+    Color *dst;
+
+    dst = (Color *) dc.clrcache.items + idx;
+    XftColorFree (xw.dpy, xw.vis, xw.cmap, dst);
+    memcpy (dst, c, sizeof (Color));
+}
 
+/*
+ * The faint variants of the palette are loaded with it, the ones of the
+ * true colours once and remembered: drawing a faint glyph doesn't allocate.
+ * When the true colours are used up the faint variant of the nearest cube
+ * colour is taken for the frame, it isn't remembered.
+ */
 int
 x_color_load_faint (uint idx)
 {
-    Color *new_c, *src;
-    uint ret;
+    Color *src;
+    ushort *memo;
+    int ret;
 
-    /* first allocate new thunk */
-    ret = dc.clrcache.nelements;
-    new_c = (Color *) thunk_alloc_next (&dc.clrcache);
+    if ( idx < FAINT_BASE )
+        return FAINT_BASE + idx;
+    if ( idx < TRUECOLOR_BASE )
+        return idx;
+
+    memo = dc.truecolor.faint + idx - TRUECOLOR_BASE;
+    if ( *memo != 0 )
+        return *memo;
 
-    /* init color */
     src = (Color *) dc.clrcache.items + idx;
+    ret = x_truecolor_load ((src->color.red   >> 9) << 16 |
+                            (src->color.green >> 9) << 8 |
+                            (src->color.blue  >> 9),
+                            False);
+    if ( ret == -1 )
+        return ret;
+    if ( ret < TRUECOLOR_BASE )
+        return FAINT_BASE + x_truecolor_cube (dc.truecolor.rgb [idx - TRUECOLOR_BASE]);
+
+    *memo = ret;
+    return ret;
+}
 
-    /* create new color */
-    if ( !x_color_load_value (src->color.red   >> 1,
-                              src->color.green >> 1,
-                              src->color.blue  >> 1,
-                              new_c) ) {
-        /* remove thunk */
-        dc.clrcache.nelements--;
-        return -1;
-    }
+/*
+ * Reverse video (DECSCNM) is applied while drawing, the palette isn't
+ * touched: the default colours are swapped and the others inverted.  The
+ * inverted true colours are remembered like the faint ones.
+ */
+uint
+x_color_resolve (uint idx)
+{
+    Color *src;
+    ushort *memo;
+    int ret;
+
+    if ( !twin_flag (MODE_REVERSE) )
+        return idx;
+
+    if ( idx == DEFAULT_FG )
+        return DEFAULT_BG;
+    if ( idx == DEFAULT_BG )
+        return DEFAULT_FG;
+
+    /* the palette and its faint variants are loaded inverted too */
+    if ( idx < REVERSE_BASE )
+        return REVERSE_BASE + idx;
 
+    memo = dc.truecolor.reverse + idx - TRUECOLOR_BASE;
+    if ( *memo != 0 )
+        return *memo;
+
+    src = (Color *) dc.clrcache.items + idx;
+    ret = x_truecolor_load (~((src->color.red   >> 8) << 16 |
+                              (src->color.green >> 8) << 8 |
+                              (src->color.blue  >> 8)) & 0xffffff,
+                            False);
+    if ( ret == -1 )
+        return idx;
+    if ( ret < TRUECOLOR_BASE )
+        return REVERSE_BASE + x_truecolor_cube (dc.truecolor.rgb [idx - TRUECOLOR_BASE]);
+
+    *memo = ret;
     return ret;
 }
 
@@ -998,8 +1442,11 @@ x_colors_load_index (void)
     Color *c;
     const char **v;
 
+    tty_x_lock ();
+
     /* free color cache */
     x_clrcache_free ();
+    x_truecolor_clear ();
 
     /* base colors */
     for ( i = 0, c = (Color *) dc.clrcache.items, v = basecolornames;
@@ -1037,6 +1484,23 @@ x_colors_load_index (void)
         dc.clrcache.nelements++;
     }
 
+    /* faint variants */
+    for ( i = 0; i < MAX_INDEX_CACHE; i++, c++ ) {
+        if ( !x_color_load_dim ((Color *) dc.clrcache.items + i, c) )
+            goto quit;
+
+        dc.clrcache.nelements++;
+    }
+
+    /* reverse video of both */
+    for ( i = 0; i < REVERSE_BASE; i++, c++ ) {
+        if ( !x_color_load_inverse ((Color *) dc.clrcache.items + i, c) )
+            goto quit;
+
+        dc.clrcache.nelements++;
+    }
+
+    tty_x_unlock ();
     return;
 
 quit:
@@ -1048,37 +1512,55 @@ int
 x_color_get (uint idx, byte *r, byte *g, byte *b)
 {
     Color *clr;
+    int ret;
+
+    tty_x_lock ();
 
     /* $idx is unsigned int therefore we don't need to check < 0
      * and the value must be < $dc.col.nelements */
-    if ( idx >= dc.clrcache.nelements )
-        return False;
+    ret = idx < dc.clrcache.nelements;
+    if ( ret ) {
+        clr = (Color *) dc.clrcache.items + idx;
 
-    clr = (Color *) dc.clrcache.items + idx;
+        *r = clr->color.red   >> 8;
+        *g = clr->color.green >> 8;
+        *b = clr->color.blue  >> 8;
+    }
 
-    *r = clr->color.red   >> 8;
-    *g = clr->color.green >> 8;
-    *b = clr->color.blue  >> 8;
-    return True;
+    tty_x_unlock ();
+    return ret;
 }
 
 int
 x_color_set_name (uint idx, const char *name)
 {
-    Color src;
-    Color *dst;
+    Color src, var;
+
+    tty_x_lock ();
 
     /* we'll check the index in the follotwg fn */
-    if ( !x_color_load_index (idx, name, &src) )
+    if ( !x_color_load_index (idx, name, &src) ) {
+        tty_x_unlock ();
         return False;
+    }
     /* $idx is between <0, countof (colnames) + 256) */
 
-    /* free current color */
-    dst = (Color *) dc.clrcache.items + idx;
-    XftColorFree (xw.dpy, xw.vis, xw.cmap, dst);
- 
-    /* and set new one */
-    memcpy (dst, &src, sizeof (Color));
+    /* set new one */
+    x_color_replace (idx, &src);
+
+    /* with its variants */
+    if ( x_color_load_inverse (&src, &var) )
+        x_color_replace (REVERSE_BASE + idx, &var);
+    if ( x_color_load_dim (&src, &src) ) {
+        x_color_replace (FAINT_BASE + idx, &src);
+        if ( x_color_load_inverse (&src, &var) )
+            x_color_replace (REVERSE_BASE + FAINT_BASE + idx, &var);
+    }
+
+    /* the buffer is drawn with the old color */
+    x_buf_stale ();
+
+    tty_x_unlock ();
     return True;
 }
 
@@ -1090,82 +1572,308 @@ x_clear (uint x1, uint y1, uint x2, uint y2)
 {
     Color *c;
 
-    /* we don't need to handle MODE_REVERSE because the colors are swapped in
-     * this mode */
-    c = (Color *) dc.clrcache.items + DEFAULT_BG;
-    XftDrawRect (xw.draw, c, x1, y1, x2 - x1, y2 - y1);
+    c = (Color *) dc.clrcache.items + x_color_resolve (DEFAULT_BG);
+    x_buf_fill (c->pixel, x1, y1, x2 - x1, y2 - y1);
 }
 
 void
-x_hints (void)
+x_buf_stale (void)
 {
-    XClassHint class = { a_name ? a_name : termname, a_class ? a_class : termname };
-    XWMHints wm = { .flags = InputHint, .input = 1 };
-    XSizeHints *sizeh;
+    /* neither the buffer nor the saved screen hold the right image */
+    xw.stale = True;
+    xw.saved = False;
+}
 
-    sizeh = XAllocSizeHints ();
+/*
+ * The buffer is a pixmap the server draws to or, built with FEATURE_SHM, an
+ * image the client draws to when the visual allows it.
+ */
+void
+x_buf_create (void)
+{
+#ifdef FEATURE_SHM
+    xw.soft = soft_create (xw.dpy, xw.vis, DefaultDepth (xw.dpy, xw.scr), tw.w, tw.h);
+    if ( xw.soft )
+        return;
+#endif  /* FEATURE_SHM */
 
-    sizeh->flags = PSize | PResizeInc | PBaseSize | PMinSize;
-    sizeh->height = tw.h;
-    sizeh->width = tw.w;
-    sizeh->height_inc = tw.ch;
-    sizeh->width_inc = tw.cw;
-    sizeh->base_width = BORDERPX << 1;
-    sizeh->base_height = BORDERPY << 1;
-    sizeh->min_width = tw.cw + (BORDERPX << 1);
-    sizeh->min_height = tw.ch + (BORDERPY << 1);
-    
-    if ( a_flags & FlagFixedGeometry ) {
-        sizeh->flags |= PMaxSize;
-        sizeh->min_width = sizeh->max_width = tw.w;
-        sizeh->min_height = sizeh->max_height = tw.h;
-    }
-    if ( xw.gm & (XValue | YValue) ) {
-        sizeh->flags |= USPosition | PWinGravity;
-        sizeh->x = xw.l;
-        sizeh->y = xw.t;
-        sizeh->win_gravity = x_geommask_to_gravity (xw.gm);
-    }
-    XSetWMProperties (xw.dpy, xw.tw, NULL, NULL, NULL, 0, sizeh, &wm, &class);
-    XFree (sizeh);
+    if ( xw.buf != None )
+        XFreePixmap (xw.dpy, xw.buf);
+    xw.buf = XCreatePixmap (xw.dpy, xw.tw, tw.w, tw.h, DefaultDepth (xw.dpy, xw.scr));
+
+    if ( xw.draw == NULL )
+        xw.draw = XftDrawCreate (xw.dpy, xw.buf, xw.vis, xw.cmap);
+    else
+        XftDrawChange (xw.draw, xw.buf);
 }
 
-int
-x_geommask_to_gravity (int mask)
+void
+x_buf_fill (ulong pixel, int x, int y, uint w, uint h)
 {
-    switch ( mask & (XNegative | YNegative) ) {
-        case 0:
-            return NorthWestGravity;
+#ifdef FEATURE_SHM
+    if ( xw.soft ) {
+        soft_fill (pixel, x, y, w, h);
+        return;
+    }
+#endif  /* FEATURE_SHM */
 
-        case XNegative:
-            return NorthEastGravity;
+    XSetForeground (xw.dpy, dc.gc, pixel);
+    XFillRectangle (xw.dpy, xw.buf, dc.gc, x, y, w, h);
+}
 
-        case YNegative:
-            return SouthWestGravity;
+void
+x_buf_fill_rects (ulong pixel, XRectangle *rects, uint n)
+{
+#ifdef FEATURE_SHM
+    if ( xw.soft ) {
+        soft_fill_rects (pixel, rects, n);
+        return;
     }
-    return SouthEastGravity;
+#endif  /* FEATURE_SHM */
+
+    XSetForeground (xw.dpy, dc.gc, pixel);
+    XFillRectangles (xw.dpy, xw.buf, dc.gc, rects, n);
 }
 
-int
-x_font_load (TermFont *f, FcPattern *pattern)
+void
+x_buf_glyphs (Color *c, const XftGlyphFontSpec *specs, int len, const XRectangle *clip)
 {
-    FcPattern *configured;
-    FcPattern *match;
-    FcResult result;
-    XGlyphInfo extents;
-    int wantattr, haveattr, ret;
+#ifdef FEATURE_SHM
+    if ( xw.soft ) {
+        soft_glyphs (c, specs, len, clip);
+        return;
+    }
+#endif  /* FEATURE_SHM */
 
-    /* Manually configure instead of calling XftMatchFont
-     * so that we can use the configured pattern for
-     * "missing glyph" lookups. */
-    configured = FcPatternDuplicate (pattern);
-    if ( !configured )
-        return -1;
+    if ( clip != NULL )
+        XftDrawSetClipRectangles (xw.draw, 0, 0, clip, 1);
 
-    FcConfigSubstitute (NULL, configured, FcMatchPattern);
-    XftDefaultSubstitute (xw.dpy, xw.scr, configured);
+    /* the glyph sets when built with them */
+#ifdef FEATURE_GLYPHSET
+    glyphset_draw (xw.draw, c, specs, len, tw.cw);
+#else
+    XftDrawGlyphFontSpec (xw.draw, c, specs, len);
+#endif  /* FEATURE_GLYPHSET */
 
-    match = FcFontMatch (NULL, configured, &result);
+    if ( clip != NULL )
+        XftDrawSetClip (xw.draw, 0);
+}
+
+void
+x_buf_put (int x, int y, uint w, uint h)
+{
+#ifdef FEATURE_SHM
+    if ( xw.soft ) {
+        soft_put (xw.tw, dc.gc, x, y, w, h);
+        return;
+    }
+#endif  /* FEATURE_SHM */
+
+    XCopyArea (xw.dpy, xw.buf, xw.tw, dc.gc, x, y, w, h, x, y);
+}
+
+void
+x_buf_sync (void)
+{
+#ifdef FEATURE_SHM
+    if ( xw.soft )
+        soft_sync ();
+#endif  /* FEATURE_SHM */
+}
+
+void
+x_buf_prewarm (const XftGlyphFontSpec *spec)
+{
+#ifdef FEATURE_SHM
+    if ( xw.soft ) {
+        soft_prewarm (spec->font, spec->glyph);
+        return;
+    }
+#endif  /* FEATURE_SHM */
+
+#ifdef FEATURE_GLYPHSET
+    glyphset_prewarm (xw.dpy, spec->font, spec->glyph, tw.cw);
+#else
+    if ( !XftGlyphExists (xw.dpy, spec->font, spec->glyph) )
+        XftFontLoadGlyphs (xw.dpy, spec->font, FcTrue, &spec->glyph, 1);
+#endif  /* FEATURE_GLYPHSET */
+}
+
+void
+x_screen_save (void)
+{
+    tty_x_lock ();
+
+    /* nothing to keep (the window may not exist yet) */
+    if ( xw.stale || (xw.buf == None && !xw.soft) ) {
+        xw.saved = False;
+        goto unlock;
+    }
+
+#ifdef FEATURE_SHM
+    if ( xw.soft ) {
+        soft_save ();
+        xw.saved = True;
+        goto unlock;
+    }
+#endif  /* FEATURE_SHM */
+
+    if ( xw.savebuf == None )
+        xw.savebuf = XCreatePixmap (xw.dpy, xw.tw, tw.w, tw.h,
+                                    DefaultDepth (xw.dpy, xw.scr));
+
+    XCopyArea (xw.dpy, xw.buf, xw.savebuf, dc.gc, 0, 0, tw.w, tw.h, 0, 0);
+    xw.saved = True;
+
+unlock:
+    tty_x_unlock ();
+}
+
+int
+x_screen_restore (void)
+{
+    int ret;
+
+    tty_x_lock ();
+
+    ret = xw.saved;
+    if ( ret ) {
+#ifdef FEATURE_SHM
+        if ( xw.soft )
+            soft_restore ();
+        else
+#endif  /* FEATURE_SHM */
+        XCopyArea (xw.dpy, xw.savebuf, xw.buf, dc.gc, 0, 0, tw.w, tw.h, 0, 0);
+        x_damage_full ();
+        xw.saved = False;
+    }
+
+    tty_x_unlock ();
+    return ret;
+}
+
+void
+x_damage_full (void)
+{
+    xw.damage.full = True;
+}
+
+/*
+ * Absolute coordinates.  The rectangle is merged with the previous one
+ * when they share a row or a column span: runs of a line and the
+ * lines of a region end up in one rectangle.
+ */
+void
+x_damage_add (int x, int y, int width, int height)
+{
+    XRectangle *r;
+
+    if ( xw.damage.full )
+        return;
+
+    xw.damage.area += width * height;
+    if ( (xw.damage.area << 1) > tw.w * tw.h ) {
+        x_damage_full ();
+        return;
+    }
+
+    if ( xw.damage.n != 0 ) {
+        r = xw.damage.rects + xw.damage.n - 1;
+
+        /* the same column span: extend down */
+        if ( r->x == x && r->width == width && r->y + r->height == y ) {
+            r->height += height;
+            return;
+        }
+        /* the same row: extend right */
+        if ( r->y == y && r->height == height && r->x + r->width == x ) {
+            r->width += width;
+            return;
+        }
+    }
+
+    if ( xw.damage.n == DAMAGE_MAX ) {
+        x_damage_full ();
+        return;
+    }
+
+    r = xw.damage.rects + xw.damage.n++;
+    r->x = x;
+    r->y = y;
+    r->width = width;
+    r->height = height;
+}
+
+void
+x_hints (void)
+{
+    XClassHint class = { a_name ? a_name : termname, a_class ? a_class : termname };
+    XWMHints wm = { .flags = InputHint, .input = 1 };
+    XSizeHints *sizeh;
+
+    sizeh = XAllocSizeHints ();
+
+    sizeh->flags = PSize | PResizeInc | PBaseSize | PMinSize;
+    sizeh->height = tw.h;
+    sizeh->width = tw.w;
+    sizeh->height_inc = tw.ch;
+    sizeh->width_inc = tw.cw;
+    sizeh->base_width = BORDERPX << 1;
+    sizeh->base_height = BORDERPY << 1;
+    sizeh->min_width = tw.cw + (BORDERPX << 1);
+    sizeh->min_height = tw.ch + (BORDERPY << 1);
+    
+    if ( a_flags & FlagFixedGeometry ) {
+        sizeh->flags |= PMaxSize;
+        sizeh->min_width = sizeh->max_width = tw.w;
+        sizeh->min_height = sizeh->max_height = tw.h;
+    }
+    if ( xw.gm & (XValue | YValue) ) {
+        sizeh->flags |= USPosition | PWinGravity;
+        sizeh->x = xw.l;
+        sizeh->y = xw.t;
+        sizeh->win_gravity = x_geommask_to_gravity (xw.gm);
+    }
+    XSetWMProperties (xw.dpy, xw.tw, NULL, NULL, NULL, 0, sizeh, &wm, &class);
+    XFree (sizeh);
+}
+
+int
+x_geommask_to_gravity (int mask)
+{
+    switch ( mask & (XNegative | YNegative) ) {
+        case 0:
+            return NorthWestGravity;
+
+        case XNegative:
+            return NorthEastGravity;
+
+        case YNegative:
+            return SouthWestGravity;
+    }
+    return SouthEastGravity;
+}
+
+int
+x_font_load (TermFont *f, FcPattern *pattern)
+{
+    FcPattern *configured;
+    FcPattern *match;
+    FcResult result;
+    XGlyphInfo extents;
+    int wantattr, haveattr, ret;
+
+    /* Manually configure instead of calling XftMatchFont
+     * so that we can use the configured pattern for
+     * "missing glyph" lookups. */
+    configured = FcPatternDuplicate (pattern);
+    if ( !configured )
+        return -1;
+
+    FcConfigSubstitute (NULL, configured, FcMatchPattern);
+    XftDefaultSubstitute (xw.dpy, xw.scr, configured);
+
+    match = FcFontMatch (NULL, configured, &result);
     if ( !match ) {
         FcPatternDestroy (configured);
         return -1;
@@ -1201,6 +1909,7 @@ x_font_load (TermFont *f, FcPattern *pattern)
 
     f->set = NULL;
     f->pattern = configured;
+    f->key = fccache_key (configured);
 
     f->ascent = f->match->ascent;
     f->descent = f->match->descent;
@@ -1225,6 +1934,10 @@ x_fonts_load (double fontsize)
     /* clear font flags */
     tw.flags &= ~FONT_MASK;
 
+    /* the cached glyph indexes refer to the old fonts */
+    x_glyphcache_clear ();
+    dc.prewarm = 0;
+
     /* name */
     if ( *a_font == '-' )
         pattern = XftXlfdParse (a_font, False, False);
@@ -1272,55 +1985,79 @@ x_fonts_load (double fontsize)
     tw.cw = ceilf(dc.rfont.width * SCALE_CW);
     tw.ch = ceilf(dc.rfont.height * SCALE_CH);
 
-    /* italic */
-    FcPatternDel(pattern, FC_SLANT);
-    FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
+    /* the bold and italic fonts are loaded on the first use: most of
+     * the sessions don't need them */
+    dc.pattern = pattern;
+    return;
 
-    ret = x_font_load (&dc.ifont, pattern);
-    if ( ret == -1 ) {
-        error (msg, a_font);
-        goto quit;
-    }
-    /* update term window flags */
-    tw.flags |= (ret << 2);
+quit:
+    die ();
+    /* NOP */
+}
 
-    /* italic/bold */
-    FcPatternDel(pattern, FC_WEIGHT);
-    FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
+TermFont *
+x_font_variant (TermFont *f, FontcacheFlags flags)
+{
+    static const char * const names [] = {
+        [FRC_ITALIC]     = "italic",
+        [FRC_BOLD]       = "bold",
+        [FRC_ITALICBOLD] = "italic/bold"
+    };
 
-    ret = x_font_load (&dc.ibfont, pattern);
-    if ( ret == -1 ) {
-        error (msg, a_font);
-        goto quit;
-    }
-    /* update term window flags */
-    tw.flags |= (ret << 4);
+    FcPattern *pattern;
+    struct timespec t;
+    int ret;
 
-    /* bold */
-    FcPatternDel(pattern, FC_SLANT);
-    FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ROMAN);
+    if ( f->match != NULL )
+        return f;
 
-    ret = x_font_load (&dc.bfont, pattern);
+    clock_gettime (CLOCK_MONOTONIC, &t);
+
+    /* the regular pattern with the slant and weight of the variant */
+    pattern = FcPatternDuplicate (dc.pattern);
+
+    FcPatternDel (pattern, FC_SLANT);
+    FcPatternAddInteger (pattern, FC_SLANT, flags & FRC_ITALIC ?
+            FC_SLANT_ITALIC : FC_SLANT_ROMAN);
+    if ( flags & FRC_BOLD ) {
+        FcPatternDel (pattern, FC_WEIGHT);
+        FcPatternAddInteger (pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
+    }
+
+    ret = x_font_load (f, pattern);
+    FcPatternDestroy (pattern);
     if ( ret == -1 ) {
-        error (msg, a_font);
-        goto quit;
+        error ("can't open %s font %s", names [flags], a_font);
+        die ();
+        /* NOP */
     }
-    /* update term window flags */
-    tw.flags |= (ret << 6);
+    /* update term window flags: 2 bits per font */
+    tw.flags |= ret << (flags == FRC_ITALIC ? 2 : flags == FRC_ITALICBOLD ? 4 : 6);
 
-    FcPatternDestroy(pattern);
-    return;
+    x_stats_time (names [flags], &t);
+    return f;
+}
 
-quit:
-    die ();
-    /* NOP */
+void
+x_font_close (XftFont *font)
+{
+#ifdef FEATURE_GLYPHSET
+    glyphset_forget (xw.dpy, font);
+#endif  /* FEATURE_GLYPHSET */
+#ifdef FEATURE_SHM
+    soft_forget (font);
+#endif  /* FEATURE_SHM */
+#ifdef FEATURE_HARFBUZZ
+    shape_forget (font);
+#endif  /* FEATURE_HARFBUZZ */
+    XftFontClose (xw.dpy, font);
 }
 
 void
 x_font_unload (TermFont *f)
 {
     if ( f->match != NULL ) {
-        XftFontClose (xw.dpy, f->match);
+        x_font_close (f->match);
         f->match = NULL;
     }
     if ( f->pattern != NULL ) {
@@ -1341,10 +2078,13 @@ fontcache_free (void)
     /* Free the loaded fonts in the font cache.  */
     fc = (Fontcache *) dc.fntcache.items;
     while ( dc.fntcache.nelements != 0 ) {
-        XftFontClose(xw.dpy, fc->font);
+        if ( fc->font != NULL )
+            x_font_close (fc->font);
         fc++;
         dc.fntcache.nelements--;
     }
+    dc.faces.open = 0;
+    fallback_clear ();
 }
 
 void
@@ -1356,6 +2096,162 @@ x_fonts_unload (void)
     x_font_unload (&dc.bfont);
     x_font_unload (&dc.ifont);
     x_font_unload (&dc.ibfont);
+
+    if ( dc.pattern != NULL ) {
+        FcPatternDestroy (dc.pattern);
+        dc.pattern = NULL;
+    }
+}
+
+uint
+x_fontset_memory (const FontSet *fs)
+{
+    uint size;
+
+    size = fs->open * FALLBACK_FACE_MEMORY;
+    if ( fs->rfont.match != NULL )
+        size += FONT_GLYPH_MEMORY;
+    if ( fs->bfont.match != NULL )
+        size += FONT_GLYPH_MEMORY;
+    if ( fs->ifont.match != NULL )
+        size += FONT_GLYPH_MEMORY;
+    if ( fs->ibfont.match != NULL )
+        size += FONT_GLYPH_MEMORY;
+
+    return size;
+}
+
+void
+x_fontset_unload (FontSet *fs)
+{
+    Fontcache *fc;
+    uint i;
+
+    for ( i = fs->fntcache.nelements, fc = (Fontcache *) fs->fntcache.items;
+          i != 0;
+          i--, fc++ ) {
+        if ( fc->font != NULL )
+            x_font_close (fc->font);
+    }
+    thunk_free (&fs->fntcache);
+    free (fs->fallback.slots);
+
+    x_font_unload (&fs->rfont);
+    x_font_unload (&fs->bfont);
+    x_font_unload (&fs->ifont);
+    x_font_unload (&fs->ibfont);
+    if ( fs->pattern != NULL )
+        FcPatternDestroy (fs->pattern);
+
+    fs->size = 0;
+}
+
+void
+x_fontset_save (void)
+{
+    FontSet cur, *fs, *slot, *lru;
+    uint i, need, size;
+
+    /* take the fonts out of the drawing context */
+    cur.rfont = dc.rfont;
+    cur.bfont = dc.bfont;
+    cur.ifont = dc.ifont;
+    cur.ibfont = dc.ibfont;
+    memset (&dc.rfont, 0, sizeof (TermFont));
+    memset (&dc.bfont, 0, sizeof (TermFont));
+    memset (&dc.ifont, 0, sizeof (TermFont));
+    memset (&dc.ibfont, 0, sizeof (TermFont));
+
+    cur.pattern = dc.pattern;
+    dc.pattern = NULL;
+
+    cur.fntcache = dc.fntcache;
+    thunk_create (&dc.fntcache, 0, sizeof (Fontcache));
+    cur.fallback = dc.fallback;
+    memset (&dc.fallback, 0, sizeof (FallbackHash));
+    cur.open = dc.faces.open;
+    dc.faces.open = 0;
+
+    cur.size = dc.usedfontsize;
+    cur.cw = tw.cw;
+    cur.ch = tw.ch;
+    cur.flags = tw.flags & FONT_MASK;
+    cur.used = ++dc.fontsetclock;
+
+    need = x_fontset_memory (&cur);
+    if ( need > FONTSET_MEMORY ) {
+        x_fontset_unload (&cur);
+        return;
+    }
+
+    /* close the least recently used sets over the budget */
+    for ( ;; ) {
+        for ( i = 0, fs = dc.fontsets, size = 0, slot = lru = NULL;
+              i < FONTSET_MAX;
+              i++, fs++ ) {
+            if ( fs->size == 0 ) {
+                slot = fs;
+                continue;
+            }
+            size += x_fontset_memory (fs);
+            if ( lru == NULL || fs->used < lru->used )
+                lru = fs;
+        }
+        if ( slot != NULL && size + need <= FONTSET_MEMORY )
+            break;
+
+        x_fontset_unload (lru);
+    }
+    *slot = cur;
+}
+
+int
+x_fontset_restore (double size)
+{
+    FontSet *fs;
+    int i;
+
+    for ( i = 0, fs = dc.fontsets; i < FONTSET_MAX; i++, fs++ ) {
+        if ( fs->size != 0 && fs->size == size )
+            break;
+    }
+    if ( i == FONTSET_MAX )
+        return False;
+
+    dc.rfont = fs->rfont;
+    dc.bfont = fs->bfont;
+    dc.ifont = fs->ifont;
+    dc.ibfont = fs->ibfont;
+    dc.pattern = fs->pattern;
+
+    thunk_free (&dc.fntcache);
+    dc.fntcache = fs->fntcache;
+    dc.fallback = fs->fallback;
+    dc.faces.open = fs->open;
+
+    dc.usedfontsize = fs->size;
+    tw.cw = fs->cw;
+    tw.ch = fs->ch;
+    tw.flags = (tw.flags & ~FONT_MASK) | fs->flags;
+
+    /* the glyph indexes refer to the fonts of the other size */
+    x_glyphcache_clear ();
+    dc.prewarm = 0;
+
+    fs->size = 0;
+    return True;
+}
+
+void
+x_fontsets_free (void)
+{
+    FontSet *fs;
+    int i;
+
+    for ( i = 0, fs = dc.fontsets; i < FONTSET_MAX; i++, fs++ ) {
+        if ( fs->size != 0 )
+            x_fontset_unload (fs);
+    }
 }
 
 int
@@ -1433,6 +2329,10 @@ x_free (void)
 {
     /* twdow */
     free (xw.specbuf);
+#ifdef FEATURE_HARFBUZZ
+    free (xw.shapebuf);
+    free (xw.shaperunes);
+#endif  /* FEATURE_HARFBUZZ */
 
     /* selection */
     free (xsel.primary);
@@ -1440,10 +2340,29 @@ x_free (void)
     /* color cache */
     x_clrcache_free ();
     thunk_free (&dc.clrcache);
+    thunk_free (&dc.truecolor.free);
 
     /* font cache */
+    if ( a_flags & FlagStats )
+        x_stats_verbose ();
+
     x_fonts_unload ();
+    x_fontsets_free ();
     thunk_free (&dc.fntcache);
+    x_boxcache_free ();
+    free (dc.boxcache.rects);
+    x_frame_free ();
+    free (dc.fallback.slots);
+    x_glyphcache_free ();
+#ifdef FEATURE_GLYPHSET
+    glyphset_free (xw.dpy);
+#endif  /* FEATURE_GLYPHSET */
+#ifdef FEATURE_HARFBUZZ
+    shape_free ();
+#endif  /* FEATURE_HARFBUZZ */
+
+    fccache_save ();
+    fccache_free ();
 
     x_ic_free ();
     x_im_free ();
@@ -1457,9 +2376,16 @@ x_free (void)
     if ( xw.buf != None )
         XFreePixmap (xw.dpy, xw.buf);
 
+    if ( xw.savebuf != None )
+        XFreePixmap (xw.dpy, xw.savebuf);
+
     if ( xw.draw != NULL )
         XftDrawDestroy (xw.draw);
 
+#ifdef FEATURE_SHM
+    soft_destroy ();
+#endif  /* FEATURE_SHM */
+
     if ( xw.tw != None )
         XDestroyWindow (xw.dpy, xw.tw);
 
@@ -1476,9 +2402,12 @@ x_create (uint cols, uint rows)
     XGCValues gcvalues;
     XColor xmousefg, xmousebg;
     Color *bg;
+    struct timespec t;
 
     pid_t thispid = getpid();
 
+    clock_gettime (CLOCK_MONOTONIC, &t);
+
     /* display */ 
     xw.dpy = XOpenDisplay (NULL);
     if ( xw.dpy == NULL ) {
@@ -1487,17 +2416,23 @@ x_create (uint cols, uint rows)
     }
     xw.scr = XDefaultScreen(xw.dpy);
     xw.vis = XDefaultVisual(xw.dpy, xw.scr);
+    x_stats_time ("display", &t);
 
     /* font */
     if (!FcInit()) {
         error ("could not init fontconfig");
         return EXIT_FAILURE;
     }
+    x_stats_time ("fontconfig", &t);
+
     x_fonts_load (0);
+    x_stats_time ("regular font", &t);
 
     /* colors */
     xw.cmap = XDefaultColormap(xw.dpy, xw.scr);
+    x_visual_init ();
     x_colors_load_index ();
+    x_stats_time ("colors", &t);
    
     /* adjust fixed twdow geometry */
     tw.w = (BORDERPX << 1) + cols * tw.cw;
@@ -1529,15 +2464,16 @@ x_create (uint cols, uint rows)
     memset(&gcvalues, 0, sizeof(gcvalues));
     gcvalues.graphics_exposures = False;
     dc.gc = XCreateGC(xw.dpy, a_winid, GCGraphicsExposures, &gcvalues);
-    xw.buf = XCreatePixmap(xw.dpy, xw.tw, tw.w, tw.h, DefaultDepth(xw.dpy, xw.scr));
-    XSetForeground(xw.dpy, dc.gc, xw.attrs.border_pixel);
-    XFillRectangle(xw.dpy, xw.buf, dc.gc, 0, 0, tw.w, tw.h);
+    x_buf_create ();
+    x_buf_fill (xw.attrs.border_pixel, 0, 0, tw.w, tw.h);
 
     /* font spec buffer */
-    xw.specbuf = x_malloc (cols * sizeof(GlyphFontSpec));
-
-    /* Xft rendering context */
-    xw.draw = XftDrawCreate(xw.dpy, xw.buf, xw.vis, xw.cmap);
+    xw.specbuf = x_malloc (cols * GLYPH_SPECS_MAX * sizeof(GlyphFontSpec));
+#ifdef FEATURE_HARFBUZZ
+    xw.shapebuf = x_malloc (cols * GLYPH_SPECS_MAX * sizeof(GlyphFontSpec));
+    xw.shaperunes = x_malloc (cols * sizeof (Rune));
+    xw.shaperow = UINT_MAX;
+#endif  /* FEATURE_HARFBUZZ */
 
     /* input methods */
     if ( !x_im_open (xw.dpy) ) {
@@ -1579,6 +2515,7 @@ x_create (uint cols, uint rows)
     x_hints ();
     XMapWindow (xw.dpy, xw.tw);
     XSync (xw.dpy, False);
+    x_stats_time ("window", &t);
 
     clock_gettime (CLOCK_MONOTONIC, &xsel.tclick1);
     clock_gettime (CLOCK_MONOTONIC, &xsel.tclick2);
@@ -1592,50 +2529,222 @@ x_create (uint cols, uint rows)
     return EXIT_SUCCESS;
 }
 
+FallbackIndex *
+fallback_probe (Rune rune, FontcacheFlags flags)
+{
+    FallbackIndex *fi;
+    uint i, mask;
+
+    mask = dc.fallback.size - 1;
+    i = (rune << 2 | flags) * 2654435761u;
+    i ^= i >> 16;
+
+    /* the table is never full: an empty slot ends the probe */
+    for ( ;; i++ ) {
+        fi = dc.fallback.slots + (i & mask);
+        if ( fi->font == -1 ||
+             (fi->rune == rune && fi->flags == flags) )
+            return fi;
+    }
+}
+
+void
+fallback_set (Rune rune, FontcacheFlags flags, int font, FT_UInt glyph)
+{
+    FallbackHash *fh = &dc.fallback;
+    FallbackIndex *old, *fi;
+    uint i, size;
+
+    /* keep the table sparse */
+    if ( (fh->count + 1) << 2 > fh->size * 3 ) {
+        old = fh->slots;
+        size = fh->size;
+
+        fh->size = size != 0 ? size << 1 : FALLBACK_INIT;
+        fh->slots = x_malloc (fh->size * sizeof (FallbackIndex));
+        fallback_clear ();
+
+        for ( i = 0; i < size; i++ ) {
+            if ( old [i].font != -1 ) {
+                *fallback_probe (old [i].rune, old [i].flags) = old [i];
+                fh->count++;
+            }
+        }
+        free (old);
+    }
+
+    fi = fallback_probe (rune, flags);
+    if ( fi->font == -1 )
+        fh->count++;
+
+    fi->rune = rune;
+    fi->flags = flags;
+    fi->font = font;
+    fi->glyph = glyph;
+}
+
+void
+fallback_clear (void)
+{
+    FallbackIndex *fi;
+    uint i;
+
+    for ( i = dc.fallback.size, fi = dc.fallback.slots;
+          i != 0;
+          i--, fi++ )
+        fi->font = -1;
+
+    dc.fallback.count = 0;
+}
+
 Fontcache *
 fontcache_find (Rune rune, FontcacheFlags flags, FT_UInt *glyphidx)
 {
     Fontcache *fc;
+    FallbackIndex *fi;
+    FcCharSet *cs;
     int i;
-    FT_UInt idx;
- 
-    /* Fallback on font cache, search the font cache for match. */
-    for ( i = dc.fntcache.nelements, fc = (Fontcache *) dc.fntcache.items;
-          i != 0;
-          i--, fc++ ) {
-        if ( fc->flags != flags )
+
+    /* one probe for the runes seen before */
+    if ( dc.fallback.count != 0 ) {
+        fi = fallback_probe (rune, flags);
+        if ( fi->font != -1 ) {
+            *glyphidx = fi->glyph;
+            fc = (Fontcache *) thunk_get_item (&dc.fntcache, fi->font);
+            fc->used = dc.frame;
+            return fc;
+        }
+    }
+
+    /* Fallback on font cache: the coverage bitmaps tell which font has
+     * the rune, so only that one is asked for the index. */
+    for ( i = 0, fc = (Fontcache *) dc.fntcache.items;
+          i < dc.fntcache.nelements;
+          i++, fc++ ) {
+        if ( fc->font == NULL || fc->flags != flags )
              continue;
- 
-        idx = XftCharIndex (xw.dpy, fc->font, rune);
-        /* Everything correct. */
-        if ( idx != 0 ) {
-            *glyphidx = idx;
+
+        /* only the returned font is stamped: the scanned ones stay
+         * candidates for fontcache_evict */
+        cs = fc->font->charset;
+        if ( cs != NULL ? FcCharSetHasChar (cs, rune) :
+                XftCharIndex (xw.dpy, fc->font, rune) != 0 ) {
+            fc->used = dc.frame;
+            *glyphidx = XftCharIndex (xw.dpy, fc->font, rune);
+            fallback_set (rune, flags, i, *glyphidx);
             return fc;
         }
         /* We got a default font for a not found glyph. */
         if ( fc->unicodep == rune ) {
-            *glyphidx = 0;  /* $idx is 0 here */
+            fc->used = dc.frame;
+            *glyphidx = 0;
+            fallback_set (rune, flags, i, 0);
             return fc;
         }
     }
     return NULL;
 }
 
-Fontcache * 
-fontcache_add (TermFont *font, Rune rune)
+void
+fontcache_evict (void)
+{
+    Fontcache *fc, *lru;
+    int i, evicted;
+
+    for ( evicted = False; dc.faces.open >= FALLBACK_FACES; ) {
+        /* the fonts of the frame being drawn are in use */
+        for ( i = dc.fntcache.nelements, fc = (Fontcache *) dc.fntcache.items, lru = NULL;
+              i != 0;
+              i--, fc++ ) {
+            if ( fc->font != NULL && fc->used != dc.frame &&
+                 (lru == NULL || fc->used < lru->used) )
+                lru = fc;
+        }
+        if ( lru == NULL )
+            break;
+
+        x_font_close (lru->font);
+        lru->font = NULL;
+        dc.faces.open--;
+        dc.faces.evicted++;
+        evicted = True;
+    }
+
+    /* the indexes may refer to the closed fonts */
+    if ( evicted ) {
+        fallback_clear ();
+        x_glyphcache_clear ();
+    }
+}
+
+Fontcache *
+fontcache_face (const FcChar8 *file, int index, FontcacheFlags flags)
+{
+    Fontcache *fc;
+    int i;
+
+    for ( i = dc.fntcache.nelements, fc = (Fontcache *) dc.fntcache.items;
+          i != 0;
+          i--, fc++ ) {
+        if ( fc->font != NULL && fc->flags == flags && fc->index == index &&
+             fc->file != NULL && strcmp ((char *) fc->file, (char *) file) == 0 ) {
+            fc->used = dc.frame;
+            dc.faces.shared++;
+            return fc;
+        }
+    }
+    return NULL;
+}
+
+FcPattern *
+fontcache_match_file (FcPattern *fcpattern, const char *file, int index)
+{
+    static const FcSetName sets [] = { FcSetSystem, FcSetApplication };
+
+    FcFontSet *fs;
+    FcPattern **p;
+    FcChar8 *pfile;
+    int i, j, pindex;
+
+    /* the face of the cached resolution, without sorting the fonts */
+    for ( i = 0; i < LEN (sets); i++ ) {
+        fs = FcConfigGetFonts (NULL, sets [i]);
+        if ( fs == NULL )
+            continue;
+
+        for ( j = fs->nfont, p = fs->fonts; j != 0; j--, p++ ) {
+            if ( FcPatternGetString (*p, FC_FILE, 0, &pfile) != FcResultMatch ||
+                 strcmp ((char *) pfile, file) != 0 )
+                continue;
+            if ( FcPatternGetInteger (*p, FC_INDEX, 0, &pindex) != FcResultMatch )
+                pindex = 0;
+            if ( pindex == index )
+                return FcFontRenderPrepare (NULL, fcpattern, *p);
+        }
+    }
+    return NULL;
+}
+
+Fontcache *
+fontcache_add (TermFont *font, Rune rune, FontcacheFlags flags)
 {
     FcPattern *fcpattern, *fontpattern;
     FcFontSet *fcsets;
     FcCharSet *fccharset;
-    Fontcache *fc;
+    Fontcache *fc, *slot;
     FcResult fcres;
     XftFont *new_font;
- 
-    /* Nothing was found. Use fontconfig to find matching font. */
-    fcsets = font->set;
-    if ( fcsets == NULL )
-        fcsets = font->set = FcFontSort (0, font->pattern, 1, 0, &fcres);
-        /* FIXME: should we check the result ($fcres)? */
+    FcChar8 *file;
+    const char *cfile;
+    int i, index;
+
+    /* resolved by this or another st before and the face is open? */
+    cfile = NULL;
+    if ( fccache_find (font->key, rune, &cfile, &index) ) {
+        fc = fontcache_face ((const FcChar8 *) cfile, index, flags);
+        if ( fc != NULL )
+            return fc;
+    }
 
     /* Nothing was found in the cache. Now use some dozen of
      * Fontconfig calls to get the font for one single character. */
@@ -1649,12 +2758,57 @@ fontcache_add (TermFont *font, Rune rune)
     FcConfigSubstitute (0, fcpattern, FcMatchPattern);
     FcDefaultSubstitute (fcpattern);
 
-    fontpattern = FcFontSetMatch (0, &fcsets, 1, fcpattern, &fcres);
-    new_font = XftFontOpenPattern (xw.dpy, fontpattern);
-    
+    /* the disk cache skips the sort; a removed font falls back to it */
+    fontpattern = NULL;
+    if ( cfile != NULL )
+        fontpattern = fontcache_match_file (fcpattern, cfile, index);
+
+    if ( fontpattern == NULL ) {
+        /* Nothing was found. Use fontconfig to find matching font. */
+        fcsets = font->set;
+        if ( fcsets == NULL )
+            fcsets = font->set = FcFontSort (0, font->pattern, 1, 0, &fcres);
+            /* FIXME: should we check the result ($fcres)? */
+
+        fontpattern = FcFontSetMatch (0, &fcsets, 1, fcpattern, &fcres);
+        cfile = NULL;
+    }
+
     FcPatternDestroy (fcpattern);
     FcCharSetDestroy (fccharset);
-    
+
+    /* is the face open already? */
+    if ( FcPatternGetString (fontpattern, FC_FILE, 0, &file) != FcResultMatch )
+        file = NULL;
+    if ( FcPatternGetInteger (fontpattern, FC_INDEX, 0, &index) != FcResultMatch )
+        index = 0;
+
+    if ( file != NULL ) {
+        if ( cfile == NULL )
+            fccache_add (font->key, rune, (char *) file, index);
+
+        fc = fontcache_face (file, index, flags);
+        if ( fc != NULL ) {
+            FcPatternDestroy (fontpattern);
+            return fc;
+        }
+    }
+
+    /* keep the glyph memory of the fallback fonts in the budget */
+    FcPatternDel (fontpattern, XFT_MAX_GLYPH_MEMORY);
+    FcPatternAddInteger (fontpattern, XFT_MAX_GLYPH_MEMORY, FALLBACK_FACE_MEMORY);
+
+    fontcache_evict ();
+    for ( i = dc.fntcache.nelements, fc = (Fontcache *) dc.fntcache.items, slot = NULL;
+          i != 0;
+          i--, fc++ ) {
+        if ( fc->font == NULL ) {
+            slot = fc;
+            break;
+        }
+    }
+
+    new_font = XftFontOpenPattern (xw.dpy, fontpattern);
     if ( new_font == NULL ) {
         error ("XftFontOpenPattern failed seeking fallback font: %s",
                        strerror(errno));
@@ -1662,11 +2816,107 @@ fontcache_add (TermFont *font, Rune rune)
         /* NOP */
     }
     /* Allocate memory for the new cache entry. */
-    fc = (Fontcache *) thunk_alloc_next (&dc.fntcache);
+    fc = slot != NULL ? slot : (Fontcache *) thunk_alloc_next (&dc.fntcache);
     fc->font = new_font;
+    fc->flags = flags;
+    fc->used = dc.frame;
     fc->unicodep = rune;
 
-    return fc;
+    /* the face strings are owned by the font's pattern */
+    if ( FcPatternGetString (new_font->pattern, FC_FILE, 0, &file) != FcResultMatch )
+        file = NULL;
+    fc->file = file;
+    fc->index = index;
+
+    dc.faces.open++;
+    dc.faces.opened++;
+    return fc;
+}
+
+void
+x_glyphcache_clear (void)
+{
+    GlyphCache *gc = &dc.glyphcache;
+    int i;
+
+    for ( i = 0; i < GLYPH_STYLES; i++ ) {
+        if ( gc->flat [i] != NULL )
+            memset (gc->flat [i], 0, GLYPH_FLAT * sizeof (GlyphIndex));
+    }
+    memset (gc->slots, 0, sizeof (gc->slots));
+}
+
+void
+x_glyphcache_free (void)
+{
+    GlyphCache *gc = &dc.glyphcache;
+    int i;
+
+    for ( i = 0; i < GLYPH_STYLES; i++ ) {
+        free (gc->flat [i]);
+        gc->flat [i] = NULL;
+    }
+}
+
+GlyphIndex *
+x_glyphcache_lookup (Rune rune, FontcacheFlags flags)
+{
+    GlyphCache *gc = &dc.glyphcache;
+    GlyphIndex *gi;
+
+    if ( rune < GLYPH_FLAT ) {
+        gi = gc->flat [flags];
+        if ( gi == NULL ) {
+            gi = gc->flat [flags] = x_malloc (GLYPH_FLAT * sizeof (GlyphIndex));
+            memset (gi, 0, GLYPH_FLAT * sizeof (GlyphIndex));
+        }
+        gi += rune;
+    } else {
+        gi = gc->slots [flags] + (rune & (GLYPH_SLOTS - 1));
+        if ( gi->rune != rune )
+            gi->font = NULL;
+    }
+    return gi;
+}
+
+void
+x_stats_time (const char *what, struct timespec *since)
+{
+    struct timespec now;
+
+    if ( (a_flags & FlagStats) == 0 )
+        return;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    info ("%s: %.2f ms", what, TIMEDIFF (now, (*since)));
+    *since = now;
+}
+
+void
+x_stats_verbose (void)
+{
+    GlyphCache *gc = &dc.glyphcache;
+    FrameBatch *fb = &dc.batch;
+    ulong total;
+#ifdef FEATURE_HARFBUZZ
+    ulong hits, misses;
+#endif  /* FEATURE_HARFBUZZ */
+
+    total = gc->hits + gc->misses;
+    info ("glyph cache: %lu lookups, %lu hits (%.1f%%)", total, gc->hits,
+            total != 0 ? gc->hits * 100.0 / total : 0.0);
+    info ("fallback fonts: %u open, %lu opened, %lu shared, %lu evicted",
+            dc.faces.open, dc.faces.opened, dc.faces.shared, dc.faces.evicted);
+    info ("glyph specs: %lu cells, %lu specs (%.1f%%)", fb->cells, fb->made,
+            fb->cells != 0 ? fb->made * 100.0 / fb->cells : 0.0);
+#ifdef FEATURE_HARFBUZZ
+    shape_stats (&hits, &misses);
+    info ("shaped runs: %lu lookups, %lu hits (%.1f%%)", hits + misses, hits,
+            hits + misses != 0 ? hits * 100.0 / (hits + misses) : 0.0);
+#endif  /* FEATURE_HARFBUZZ */
+    info ("true colours: %u entries, %lu loaded, %lu sweeps",
+            dc.clrcache.nelements - TRUECOLOR_BASE, dc.truecolor.loaded,
+            dc.truecolor.swept);
 }
 
 TermFont *
@@ -1676,17 +2926,17 @@ x_glyph_attr_to_font (GlyphAttribute attr, FontcacheFlags *retflags)
         if ( attr & ATTR_ITALIC ) {
             /* italic/bold */
             *retflags = FRC_ITALICBOLD;
-            return &dc.ibfont;
+            return x_font_variant (&dc.ibfont, FRC_ITALICBOLD);
         }
         /* bold */
         *retflags = FRC_BOLD;
-        return &dc.bfont;
+        return x_font_variant (&dc.bfont, FRC_BOLD);
     }
    
     if ( attr & ATTR_ITALIC ) {
         /* italic */
         *retflags = FRC_ITALIC;
-        return &dc.ifont;
+        return x_font_variant (&dc.ifont, FRC_ITALIC);
     }
     
     /* regular */
@@ -1700,16 +2950,37 @@ x_glyph_make_font_spec (XftGlyphFontSpec *ps, Rune rune, GlyphAttribute attr, Te
     FT_UInt glyphidx;
     Fontcache *fc;
     FontcacheFlags flags;
+    GlyphIndex *gi;
 
     /* Determine font for glyph if different from previous glyph. */
     if ( font == NULL )
         font = x_glyph_attr_to_font (attr, retflags);
 
+    /* box drawing: x_glyph_draw_font_specs draws it, see x_box_draw */
+    if ( boxdraw_is (rune) && !(attr & ATTR_WIDE) ) {
+        ps->font = NULL;
+        ps->glyph = rune;
+        return font;
+    }
+
+    /* resolved before? */
+    gi = x_glyphcache_lookup (rune, *retflags);
+    if ( gi->font != NULL ) {
+        dc.glyphcache.hits++;
+        if ( gi->face != -1 )
+            ((Fontcache *) thunk_get_item (&dc.fntcache, gi->face))->used = dc.frame;
+        ps->font = gi->font;
+        ps->glyph = gi->glyph;
+        return font;
+    }
+    dc.glyphcache.misses++;
+
     /* Lookup character index with default font. */
     glyphidx = XftCharIndex (xw.dpy, font->match, rune);
-    if ( glyphidx != 0 )
+    if ( glyphidx != 0 ) {
         ps->font = font->match;
-    else {
+        gi->face = -1;
+    } else {
         /* fetch flags */
         flags = *retflags;
 
@@ -1718,15 +2989,23 @@ x_glyph_make_font_spec (XftGlyphFontSpec *ps, Rune rune, GlyphAttribute attr, Te
         if ( fc == NULL ) {
             /* Nothing was found in the cache; let's add new font for
              * this character */
-            fc = fontcache_add (font, rune);
-            fc->flags = flags;
+            fc = fontcache_add (font, rune, flags);
             glyphidx = XftCharIndex (xw.dpy, fc->font, rune);
+
+            /* remember the result, even a missing glyph: fontconfig
+             * isn't asked for the rune again */
+            fallback_set (rune, flags, fc - (Fontcache *) dc.fntcache.items, glyphidx);
         }
         ps->font = fc->font;
+        gi->face = fc - (Fontcache *) dc.fntcache.items;
     }
 
     /* add new entry */
     ps->glyph = glyphidx;
+
+    gi->font = ps->font;
+    gi->glyph = glyphidx;
+    gi->rune = rune;
     return font;
 }
 
@@ -1737,6 +3016,8 @@ x_glyph_make_font_specs (XftGlyphFontSpec *specs, const TermGlyph *glyphs, int l
     int numspecs;
     TermFont *font, *prevfont;
     FontcacheFlags flags;
+    const Rune *marks;
+    uint n;
     float yp, runewidth;
     
     float xp = BORDERPX + col * tw.cw;
@@ -1750,6 +3031,12 @@ x_glyph_make_font_specs (XftGlyphFontSpec *specs, const TermGlyph *glyphs, int l
         if ( attr == ATTR_WDUMMY )
             continue;
 
+        /* no spec for a blank; the decorations are drawn per run */
+        if ( GLYPH_BLANK (glyphs) ) {
+            xp += tw.cw;
+            continue;
+        }
+
         /* Determine font for glyph if different from previous glyph. */
         font = x_glyph_make_font_spec (specs, glyphs->rune, attr, prevfont, &flags);
         
@@ -1763,22 +3050,270 @@ x_glyph_make_font_specs (XftGlyphFontSpec *specs, const TermGlyph *glyphs, int l
         }
         specs->x = (short) xp;
         specs->y = (short) yp;
-
-        xp += runewidth;
         specs++;
         numspecs++;
+
+        /* the marks are stacked on the base */
+        if ( glyphs->cluster != 0 ) {
+            for ( marks = cluster_get (glyphs->cluster, &n);
+                  n != 0;
+                  n--, marks++, specs++, numspecs++ ) {
+                x_glyph_make_font_spec (specs, *marks, attr, font, &flags);
+                specs->x = (short) xp;
+                specs->y = (short) yp;
+            }
+        }
+        xp += runewidth;
     }
 
     return numspecs;
 }
 
+/* the specs x_glyph_make_font_specs makes for the cell */
+uint
+x_glyph_nspecs (const TermGlyph *tg)
+{
+    if ( tg->cluster != 0 )
+        return 1 + cluster_len (tg->cluster);
+
+    return !GLYPH_BLANK (tg);
+}
+
+#ifdef FEATURE_HARFBUZZ
+/*
+ * The sequences of cells of a style run whose glyphs come from the font of
+ * the style are shaped; the boxes, the fallback glyphs, the clusters and
+ * the cursor cell are copied.  Returns the specs to draw and their number
+ * in $nspecs.
+ */
+const XftGlyphFontSpec *
+x_glyph_shape (const XftGlyphFontSpec *specs, uint *nspecs, const TermGlyph *tg, uint len,
+        uint col, uint row)
+{
+    XftGlyphFontSpec *out;
+    FontcacheFlags flags;
+    XftFont *font;
+    uint n, k;
+
+    font = x_glyph_attr_to_font (tg->attr, &flags)->match;
+    out = xw.shapebuf;
+
+    /* no cursor on the row: the column is never reached */
+    if ( row != xw.shaperow )
+        row = UINT_MAX;
+
+    for ( n = 0; len != 0; len--, tg++, col++ ) {
+        if ( tg->attr & ATTR_WDUMMY )
+            continue;
+
+        k = x_glyph_nspecs (tg);
+        if ( k == 1 && specs->font == font &&
+             (row == UINT_MAX || col != xw.shapecol) ) {
+            xw.shaperunes [n++] = tg->rune;
+            specs++;
+            continue;
+        }
+
+        out = x_glyph_shape_seq (out, specs - n, n, font);
+        n = 0;
+        memcpy (out, specs, k * sizeof (XftGlyphFontSpec));
+        out += k;
+        specs += k;
+    }
+    out = x_glyph_shape_seq (out, specs - n, n, font);
+
+    *nspecs = out - xw.shapebuf;
+    return xw.shapebuf;
+}
+
+/* the glyphs are placed relative to the specs of their runes */
+XftGlyphFontSpec *
+x_glyph_shape_seq (XftGlyphFontSpec *out, const XftGlyphFontSpec *specs, uint n, XftFont *font)
+{
+    const ShapedGlyph *g;
+    uint nglyphs;
+
+    /* a single rune has nothing to join with; too many glyphs don't fit */
+    if ( n < 2 ||
+         (g = shape_run (font, xw.shaperunes, n, &nglyphs)) == NULL ||
+         nglyphs > n * GLYPH_SPECS_MAX ) {
+        memcpy (out, specs, n * sizeof (XftGlyphFontSpec));
+        return out + n;
+    }
+
+    for ( ; nglyphs != 0; nglyphs--, g++, out++ ) {
+        out->font = font;
+        out->glyph = g->glyph;
+        out->x = specs [g->cell].x + g->x;
+        out->y = specs [g->cell].y + g->y;
+    }
+    return out;
+}
+
+/* the cursor moves to the cell: it breaks the ligature it lands on */
 void
-x_glyph_draw_font_specs (const XftGlyphFontSpec *specs, uint len,
-       uint col, uint row, GlyphAttribute attr, uint fg, uint bg)
+x_glyph_shape_break (uint col, uint row)
 {
-    Color *clrfg, *clrbg;
-    XRectangle r;
-    int winx, winy, width;
+    xw.shapecol = col;
+    xw.shaperow = twin_flag (MODE_HIDE) ? UINT_MAX : row;
+}
+
+/* $tg is shaped in the sequence of $base */
+int
+x_glyph_shape_joins (const TermGlyph *tg, const TermGlyph *base, TermFont *font, FontcacheFlags *flags)
+{
+    XftGlyphFontSpec spec;
+
+    if ( tg->attr != base->attr || tg->fg != base->fg || tg->bg != base->bg ||
+         x_glyph_nspecs (tg) != 1 )
+        return False;
+
+    x_glyph_make_font_spec (&spec, tg->rune, tg->attr, font, flags);
+    return spec.font == font->match;
+}
+
+/* the glyphs of $n runes as x_glyph_shape_seq draws them */
+const ShapedGlyph *
+x_glyph_shape_part (XftFont *font, const Rune *runes, uint n, uint *nglyphs, ShapedGlyph *one)
+{
+    if ( n >= 2 )
+        return shape_run (font, runes, n, nglyphs);
+
+    /* a single rune isn't shaped */
+    *nglyphs = n;
+    if ( n == 1 ) {
+        one->glyph = XftCharIndex (xw.dpy, font, *runes);
+        one->cell = 0;
+        one->x = one->y = 0;
+    }
+    return one;
+}
+
+/*
+ * The cells of $line whose glyphs change when the sequence is broken at
+ * $col: [$col1, $col2).  The glyphs on both sides of the cell are shaped
+ * apart and compared with the ones of the whole sequence.  Returns False
+ * if none changes, the cursor joins or breaks no ligature there.
+ */
+int
+x_glyph_shape_extent (Line line, uint col, uint *col1, uint *col2)
+{
+    const ShapedGlyph *u, *l, *r;
+    const TermGlyph *base, *tg;
+    ShapedGlyph lone, rone;
+    TermFont *font;
+    FontcacheFlags flags;
+    FT_UInt glyph;
+    uint start, end, cols, i, n, k, a, b, nu, nl, nr, same;
+
+    base = line + col;
+    if ( base->attr & ATTR_WDUMMY || x_glyph_nspecs (base) != 1 )
+        return False;
+
+    font = x_glyph_attr_to_font (base->attr, &flags);
+    if ( !x_glyph_shape_joins (base, base, font, &flags) )
+        return False;
+
+    /* the sequence of the cell; the wide dummies don't break it */
+    for ( start = col; start != 0; start-- ) {
+        tg = line + start - 1;
+        if ( !(tg->attr & ATTR_WDUMMY) && !x_glyph_shape_joins (tg, base, font, &flags) )
+            break;
+    }
+    while ( line [start].attr & ATTR_WDUMMY )
+        start++;
+
+    cols = tw.tw / tw.cw;
+    for ( end = col + 1; end < cols; end++ ) {
+        tg = line + end;
+        if ( !(tg->attr & ATTR_WDUMMY) && !x_glyph_shape_joins (tg, base, font, &flags) )
+            break;
+    }
+
+    for ( i = start, n = 0, k = 0; i < end; i++ ) {
+        if ( line [i].attr & ATTR_WDUMMY )
+            continue;
+        if ( i == col )
+            k = n;
+        xw.shaperunes [n++] = line [i].rune;
+    }
+    if ( n < 2 )
+        return False;
+
+    /* the three runs are looked up one after the other: a set of the cache
+     * holds them all, none is dropped for the next one */
+    if ( (u = shape_run (font->match, xw.shaperunes, n, &nu)) == NULL ||
+         (l = x_glyph_shape_part (font->match, xw.shaperunes, k, &nl, &lone)) == NULL ||
+         (r = x_glyph_shape_part (font->match, xw.shaperunes + k + 1, n - k - 1, &nr, &rone)) == NULL )
+        return False;
+
+    /* the cell itself is drawn with its own glyph */
+    glyph = XftCharIndex (xw.dpy, font->match, xw.shaperunes [k]);
+    for ( i = 0, same = 0; i < nu; i++ ) {
+        if ( u [i].cell == k )
+            same += u [i].glyph == glyph && u [i].x == 0 && u [i].y == 0 ? 1 : 2;
+    }
+
+    /* left of the cell: the first glyph that differs */
+    for ( i = 0; i < nu && i < nl && u [i].cell < k; i++ ) {
+        if ( u [i].glyph != l [i].glyph || u [i].cell != l [i].cell ||
+             u [i].x != l [i].x || u [i].y != l [i].y )
+            break;
+    }
+    a = k;
+    if ( i < nu && u [i].cell < a )
+        a = u [i].cell;
+    if ( i < nl && l [i].cell < a )
+        a = l [i].cell;
+
+    /* right of it: the last one */
+    for ( ; nu != 0 && nr != 0 && u [nu - 1].cell > k; nu--, nr-- ) {
+        if ( u [nu - 1].glyph != r [nr - 1].glyph || u [nu - 1].cell != r [nr - 1].cell + k + 1 ||
+             u [nu - 1].x != r [nr - 1].x || u [nu - 1].y != r [nr - 1].y )
+            break;
+    }
+    b = k + 1;
+    if ( nu != 0 && u [nu - 1].cell >= b )
+        b = u [nu - 1].cell + 1;
+    if ( nr != 0 && r [nr - 1].cell + k + 2 > b )
+        b = r [nr - 1].cell + k + 2;
+
+    if ( a == k && b == k + 1 && same == 1 )
+        return False;
+
+    *col2 = end;
+    for ( i = start, n = 0; i < end; i++ ) {
+        if ( line [i].attr & ATTR_WDUMMY )
+            continue;
+        if ( n == a )
+            *col1 = i;
+        if ( n == b )
+            *col2 = i;
+        n++;
+    }
+    return True;
+}
+#endif  /* FEATURE_HARFBUZZ */
+
+/*
+ * The requests are collected in dc.batch and sent by x_frame_flush: the
+ * backgrounds, the box drawing glyphs, the glyphs and the decorations,
+ * each group with one request per colour.  The run covers $cells cells
+ * (wide ones counted once) of which only the $len non-blank have a spec.
+ * $clip clips all the glyphs to the run; otherwise only the ones of the
+ * fonts overhanging the cell.
+ */
+void
+x_glyph_draw_font_specs (const XftGlyphFontSpec *specs, uint len, uint cells,
+       uint col, uint row, GlyphAttribute attr, uint fg, uint bg, int clip)
+{
+    FrameBatch *fb = &dc.batch;
+    FrameGlyph *g;
+    FrameBox *b;
+    XftFont *f;
+    XRectangle r, *cr;
+    int winx, winy, width, runewidth;
+    uint runclip;
  
     /* Fallback on color display for attributes not supported by the font */
     if ( attr & ATTR_BOLD ) {
@@ -1810,6 +3345,10 @@ x_glyph_draw_font_specs (const XftGlyphFontSpec *specs, uint len,
             fg = width;
     }
 
+    /* reverse video */
+    fg = x_color_resolve (fg);
+    bg = x_color_resolve (bg);
+
     /* reverse single glyph? */
     if ( attr & ATTR_REVERSE ) {
         width = fg;
@@ -1820,102 +3359,395 @@ x_glyph_draw_font_specs (const XftGlyphFontSpec *specs, uint len,
           attr & ATTR_INVISIBLE )
         fg = bg;
 
-    /* fetch colors from cache */
-    clrfg = (Color *) dc.clrcache.items + fg;
-    clrbg = (Color *) dc.clrcache.items + bg;
-
     /* Intelligent cleaning up of the borders. */
     winx = BORDERPX + col * tw.cw;
     winy = BORDERPY + row * tw.ch;
 
-    width = tw.cw * len;
+    width = tw.cw * cells;
     if ( attr & ATTR_WIDE )
         width <<= 1;
 
     r.y = winy + tw.ch >= BORDERPY + tw.th;  /* variable is used as a temp only */
+
+    /* the cells and the cleaned borders are copied to the window */
+    r.x = winx + width >= BORDERPX + tw.tw;  /* the same applies to $r.x */
+    x_damage_add (col == 0 ? 0 : winx,
+                  row == 0 ? 0 : winy,
+                  (r.x ? tw.w : winx + width) - (col == 0 ? 0 : winx),
+                  (r.y ? tw.h : winy + tw.ch) - (row == 0 ? 0 : winy));
  
     if (col == 0)
-        x_clear (0,
+        x_frame_fill (&fb->fills, x_color_resolve (DEFAULT_BG),
+                 0,
                  row == 0 ? 0 : winy,
                  BORDERPX,
                  winy + tw.ch + (r.y ? tw.h : 0));
 
     if ( winx + width >= BORDERPX + tw.tw )
-        x_clear (winx + width,
+        x_frame_fill (&fb->fills, x_color_resolve (DEFAULT_BG),
+                 winx + width,
                  row == 0 ? 0 : winy,
                  tw.w,
                  r.y ? tw.h : winy + tw.ch);
 
     if ( row == 0 )
-        x_clear (winx,
+        x_frame_fill (&fb->fills, x_color_resolve (DEFAULT_BG),
+                 winx,
                  0,
                  winx + width,
                  BORDERPY);
 
     if ( r.y )
-        x_clear (winx,
+        x_frame_fill (&fb->fills, x_color_resolve (DEFAULT_BG),
+                 winx,
                  winy + tw.ch,
                  winx + width,
                  tw.h);
 
     /* Clean up the region we want to draw to. */
-    XftDrawRect (xw.draw, clrbg, winx, winy, width, tw.ch);
-
-    /* Set the clip region because Xft is sometimes dirty. */
-    r.x = 0;
-    r.y = 0;
-    r.height = tw.ch;
-    r.width = width;
-
-    XftDrawSetClipRectangles (xw.draw, winx, winy, &r, 1);
+    x_frame_fill (&fb->fills, bg, winx, winy, winx + width, winy + tw.ch);
+
+    /* the glyphs; Xft is sometimes dirty: the ones which may overhang
+     * the cell are clipped to the run, which has one clip for them all */
+    runewidth = attr & ATTR_WIDE ? tw.cw << 1 : tw.cw;
+    runclip = 0;
+    for ( ; len != 0; len--, specs++ ) {
+        f = specs->font;
+        if ( f == NULL ) {
+            b = (FrameBox *) thunk_alloc_next (&fb->boxes);
+            b->rune = specs->glyph;
+            b->x = specs->x;
+            b->y = winy;
+            b->fg = fg;
+            b->bg = bg;
+            continue;
+        }
 
-    /* Render the glyphs. */
-    XftDrawGlyphFontSpec (xw.draw, clrfg, specs, len);
+        g = (FrameGlyph *) thunk_alloc_next (&fb->glyphs);
+        g->color = fg;
+        g->spec = *specs;
+        g->clip = 0;
+
+        if ( clip || f->ascent > specs->y - winy ||
+             f->descent > winy + tw.ch - specs->y ||
+             f->max_advance_width > runewidth ) {
+            if ( runclip == 0 ) {
+                cr = (XRectangle *) thunk_alloc_next (&fb->clips);
+                cr->x = winx;
+                cr->y = winy;
+                cr->width = width;
+                cr->height = tw.ch;
+                runclip = fb->clips.nelements;
+            }
+            g->clip = runclip;
+        }
+    }
 
     /* Render underline and strikethrough. */
     if (attr & ATTR_UNDERLINE)
-        XftDrawRect (xw.draw, clrfg, winx, winy + dc.rfont.ascent + 1, width, 1);
+        x_frame_fill (&fb->decors, fg, winx, winy + dc.rfont.ascent + 1,
+                winx + width, winy + dc.rfont.ascent + 2);
 
     if (attr & ATTR_STRUCK)
-        XftDrawRect (xw.draw, clrfg, winx, winy + (dc.rfont.ascent << 1) / 3, width, 1);
+        x_frame_fill (&fb->decors, fg, winx, winy + (dc.rfont.ascent << 1) / 3,
+                winx + width, winy + (dc.rfont.ascent << 1) / 3 + 1);
+}
+
+void
+x_frame_init (void)
+{
+    FrameBatch *fb = &dc.batch;
+
+    thunk_create (&fb->fills, 0, sizeof (FrameRect));
+    thunk_create (&fb->boxes, 0, sizeof (FrameBox));
+    thunk_create (&fb->glyphs, 0, sizeof (FrameGlyph));
+    thunk_create (&fb->clips, 0, sizeof (XRectangle));
+    thunk_create (&fb->decors, 0, sizeof (FrameRect));
+    thunk_create (&fb->rects, 0, sizeof (XRectangle));
+    thunk_create (&fb->specs, 0, sizeof (XftGlyphFontSpec));
+}
+
+void
+x_frame_free (void)
+{
+    FrameBatch *fb = &dc.batch;
+
+    thunk_free (&fb->fills);
+    thunk_free (&fb->boxes);
+    thunk_free (&fb->glyphs);
+    thunk_free (&fb->clips);
+    thunk_free (&fb->decors);
+    thunk_free (&fb->rects);
+    thunk_free (&fb->specs);
+}
 
-    /* Reset clip to none. */
-    XftDrawSetClip (xw.draw, 0);
+void
+x_frame_fill (Thunk *list, uint color, int x1, int y1, int x2, int y2)
+{
+    FrameRect *fr;
+
+    if ( x2 <= x1 || y2 <= y1 )
+        return;
+
+    fr = (FrameRect *) thunk_alloc_next (list);
+    fr->color = color;
+    fr->r.x = x1;
+    fr->r.y = y1;
+    fr->r.width = x2 - x1;
+    fr->r.height = y2 - y1;
+}
+
+int
+x_frame_cmp_rect (const void *a, const void *b)
+{
+    uint ca = ((const FrameRect *) a)->color;
+    uint cb = ((const FrameRect *) b)->color;
+
+    return ca < cb ? -1 : ca > cb;
+}
+
+int
+x_frame_cmp_glyph (const void *a, const void *b)
+{
+    const FrameGlyph *ga = a, *gb = b;
+
+    /* the unclipped glyphs of a colour first, then those of each run */
+    if ( ga->color != gb->color )
+        return ga->color < gb->color ? -1 : 1;
+
+    return ga->clip < gb->clip ? -1 : ga->clip > gb->clip;
+}
+
+void
+x_frame_flush_rects (Thunk *list)
+{
+    FrameRect *fr, *end;
+    XRectangle *r;
+    Color *c;
+    uint color;
+
+    qsort (list->items, list->nelements, sizeof (FrameRect), x_frame_cmp_rect);
+
+    for ( fr = (FrameRect *) list->items, end = fr + list->nelements; fr != end; ) {
+        /* the rectangles of one colour */
+        color = fr->color;
+        dc.batch.rects.nelements = 0;
+        for ( ; fr != end && fr->color == color; fr++ ) {
+            r = (XRectangle *) thunk_alloc_next (&dc.batch.rects);
+            *r = fr->r;
+        }
+        c = (Color *) dc.clrcache.items + color;
+        x_buf_fill_rects (c->pixel,
+                (XRectangle *) dc.batch.rects.items, dc.batch.rects.nelements);
+    }
+    list->nelements = 0;
+}
+
+void
+x_frame_flush (void)
+{
+    FrameBatch *fb = &dc.batch;
+    FrameGlyph *g, *end;
+    FrameBox *b;
+    XftGlyphFontSpec *spec;
+    Color *c;
+    uint i, color, clip;
+
+    /* backgrounds */
+    x_frame_flush_rects (&fb->fills);
+
+    /* box drawing glyphs are whole cells */
+    for ( i = fb->boxes.nelements, b = (FrameBox *) fb->boxes.items; i != 0; i--, b++ )
+        x_box_draw (b->rune, b->x, b->y,
+                (Color *) dc.clrcache.items + b->fg,
+                (Color *) dc.clrcache.items + b->bg);
+    fb->boxes.nelements = 0;
+
+    /* glyphs */
+    qsort (fb->glyphs.items, fb->glyphs.nelements, sizeof (FrameGlyph), x_frame_cmp_glyph);
+
+    for ( g = (FrameGlyph *) fb->glyphs.items, end = g + fb->glyphs.nelements; g != end; ) {
+        /* the ones fitting their cells at once, then a run at a time */
+        color = g->color;
+        clip = g->clip;
+        c = (Color *) dc.clrcache.items + color;
+
+        fb->specs.nelements = 0;
+        for ( ; g != end && g->color == color && g->clip == clip; g++ ) {
+            spec = (XftGlyphFontSpec *) thunk_alloc_next (&fb->specs);
+            *spec = g->spec;
+        }
+        x_buf_glyphs (c, (XftGlyphFontSpec *) fb->specs.items, fb->specs.nelements,
+                clip == 0 ? NULL : (XRectangle *) fb->clips.items + clip - 1);
+    }
+    fb->glyphs.nelements = 0;
+    fb->clips.nelements = 0;
+
+    /* underlines and strikethroughs */
+    x_frame_flush_rects (&fb->decors);
+}
+
+/* the rune and the marks of $tg; its attributes select the font */
+void
+x_glyph_draw (const TermGlyph *tg, uint col, uint row, GlyphAttribute attr, uint fg, uint bg)
+{
+    XftGlyphFontSpec specs [GLYPH_SPECS_MAX];
+    uint numspecs;
+
+    numspecs = x_glyph_make_font_specs (specs, tg, 1, col, row);
+    x_glyph_draw_font_specs (specs, numspecs, 1, col, row, attr, fg, bg, True);
+    x_frame_flush ();
+}
+
+/* the pixmaps and the rectangle buffer follow the cell size */
+XRectangle *
+x_box_rects (void)
+{
+    BoxCache *bc = &dc.boxcache;
+
+    if ( bc->cw != tw.cw || bc->ch != tw.ch ) {
+        x_boxcache_free ();
+        bc->cw = tw.cw;
+        bc->ch = tw.ch;
+        bc->rects = x_realloc (bc->rects,
+                BOXDRAW_MAX (tw.cw, tw.ch) * sizeof (XRectangle));
+    }
+    return bc->rects;
+}
+
+BoxGlyph *
+x_box_pixmap (Rune rune, Color *fg, Color *bg)
+{
+    BoxCache *bc = &dc.boxcache;
+    BoxGlyph *bx;
+    XRectangle *rects;
+    uint n;
+
+    rects = x_box_rects ();
+
+    bx = bc->slots + ((rune * 31 + fg->pixel * 7 + bg->pixel) & (BOX_SLOTS - 1));
+    if ( bx->pm == None || bx->rune != rune ||
+         bx->fg != fg->pixel || bx->bg != bg->pixel ) {
+        if ( bx->pm == None )
+            bx->pm = XCreatePixmap (xw.dpy, xw.tw, tw.cw, tw.ch,
+                    DefaultDepth (xw.dpy, xw.scr));
+
+        bx->rune = rune;
+        bx->fg = fg->pixel;
+        bx->bg = bg->pixel;
+
+        XSetForeground (xw.dpy, dc.gc, bg->pixel);
+        XFillRectangle (xw.dpy, bx->pm, dc.gc, 0, 0, tw.cw, tw.ch);
+
+        n = boxdraw_rects (rune, tw.cw, tw.ch, rects);
+        XSetForeground (xw.dpy, dc.gc, fg->pixel);
+        XFillRectangles (xw.dpy, bx->pm, dc.gc, rects, n);
+    }
+    return bx;
 }
 
 void
-x_glyph_draw (Rune rune, uint col, uint row, GlyphAttribute attr, uint fg, uint bg)
+x_box_draw (Rune rune, int x, int y, Color *fg, Color *bg)
+{
+    BoxGlyph *bx;
+
+#ifdef FEATURE_SHM
+    /* the client draws the rectangles at once */
+    if ( xw.soft ) {
+        XRectangle *rects, *r;
+        uint n;
+
+        rects = x_box_rects ();
+        n = boxdraw_rects (rune, tw.cw, tw.ch, rects);
+        for ( r = rects; r != rects + n; r++ ) {
+            r->x += x;
+            r->y += y;
+        }
+        soft_fill (bg->pixel, x, y, tw.cw, tw.ch);
+        soft_fill_rects (fg->pixel, rects, n);
+        return;
+    }
+#endif  /* FEATURE_SHM */
+
+    bx = x_box_pixmap (rune, fg, bg);
+    XCopyArea (xw.dpy, bx->pm, xw.buf, dc.gc, 0, 0, tw.cw, tw.ch, x, y);
+}
+
+/*
+ * Idle passes of the main loop warm the caches up after the fonts are
+ * loaded: the printable ASCII glyphs of the regular font and of the bold
+ * and italic ones already opened are resolved and rasterized, and the box
+ * drawing ones drawn in the default colours, PREWARM_SLICE at a time.
+ * Returns True if it did some.
+ */
+int
+x_prewarm (void)
 {
+    static const GlyphAttribute styles [] = { 0, ATTR_BOLD, ATTR_ITALIC };
+    TermFont * const fonts [] = { &dc.rfont, &dc.bfont, &dc.ifont };
+    const uint nascii = sizeof (ascii_printable) - 1;
+    const uint nboxes = 0x25a0 - 0x2500;
+
     XftGlyphFontSpec spec;
     FontcacheFlags flags;
-    TermFont *font;
+    uint i, n;
+
+    for ( n = 0; n < PREWARM_SLICE && dc.prewarm < LEN (styles) * nascii + nboxes;
+          n++, dc.prewarm++ ) {
+        i = dc.prewarm;
+        if ( i < LEN (styles) * nascii ) {
+            /* the variants are opened when drawn: the ones not opened
+             * yet are skipped, opening them would hold the input back */
+            if ( fonts [i / nascii]->match == NULL ) {
+                dc.prewarm = (i / nascii + 1) * nascii - 1;
+                continue;
+            }
+            x_glyph_make_font_spec (&spec, ascii_printable [i % nascii],
+                    styles [i / nascii], NULL, &flags);
+            x_buf_prewarm (&spec);
+        } else if ( !xw.soft ) {
+            /* the client draws the boxes without a cache */
+            x_box_pixmap (0x2500 + i - LEN (styles) * nascii,
+                    (Color *) dc.clrcache.items + DEFAULT_FG,
+                    (Color *) dc.clrcache.items + DEFAULT_BG);
+        }
+    }
+    return n != 0;
+}
 
-    font = x_glyph_make_font_spec (&spec, rune, attr, NULL, &flags);
-    spec.x = BORDERPX + col * tw.cw;
-    spec.y = BORDERPY + row * tw.ch + font->ascent;
+void
+x_boxcache_free (void)
+{
+    BoxGlyph *bg;
+    uint i;
 
-    x_glyph_draw_font_specs (&spec, 1, col, row, attr, fg, bg);
+    for ( i = BOX_SLOTS, bg = dc.boxcache.slots; i != 0; i--, bg++ ) {
+        if ( bg->pm != None ) {
+            XFreePixmap (xw.dpy, bg->pm);
+            bg->pm = None;
+        }
+    }
 }
 
 void
 x_cursor_draw_inactive (Color *drawcol, uint col, uint row)
 {
-    XftDrawRect (xw.draw, drawcol,
+    x_buf_fill (drawcol->pixel,
         BORDERPX + col * tw.cw,
         BORDERPY + row * tw.ch,
         tw.cw - 1, 1);
 
-    XftDrawRect (xw.draw, drawcol,
+    x_buf_fill (drawcol->pixel,
         BORDERPX + col * tw.cw,
         BORDERPY + row * tw.ch,
         1, tw.ch - 1);
 
-    XftDrawRect (xw.draw, drawcol,
+    x_buf_fill (drawcol->pixel,
         BORDERPX + (col + 1) * tw.cw - 1,
         BORDERPY + row * tw.ch,
         1, tw.ch - 1);
 
-    XftDrawRect (xw.draw, drawcol,
+    x_buf_fill (drawcol->pixel,
         BORDERPX + col * tw.cw,
         BORDERPY + (row + 1) * tw.ch - 1,
         tw.cw, 1);
@@ -1927,7 +3759,7 @@ x_cursor_draw_non_glyph (Color *drawcol, uint col, uint row)
     switch ( tw.cursor ) {
         case 3:  /* Blinking Underline */
         case 4:  /* Steady Underline */
-            XftDrawRect (xw.draw, drawcol,
+            x_buf_fill (drawcol->pixel,
                 BORDERPX + col * tw.cw,
                 BORDERPY + (row + 1) * tw.ch - CURSOR_THICKNESS,
                 tw.cw, CURSOR_THICKNESS);
@@ -1935,7 +3767,7 @@ x_cursor_draw_non_glyph (Color *drawcol, uint col, uint row)
 
         case 5:  /* Blinking bar */
         case 6:  /* Steady bar */
-            XftDrawRect (xw.draw, drawcol,
+            x_buf_fill (drawcol->pixel,
                 BORDERPX + col * tw.cw,
                 BORDERPY + row * tw.ch,
                 CURSOR_THICKNESS, tw.ch);
@@ -1949,6 +3781,13 @@ x_cursor_remove (TermGlyph *tg, uint col, uint row)
 {
     GlyphAttribute attr;
 
+    /* the lines of the frame go first */
+    x_frame_flush ();
+
+    /* NULL: the cells around it were redrawn */
+    if ( tg == NULL )
+        return;
+
     /* fetch */
     attr = tg->attr;
 
@@ -1956,39 +3795,47 @@ x_cursor_remove (TermGlyph *tg, uint col, uint row)
     if ( t_selected (col, row) )
         attr ^= ATTR_REVERSE;
 
-    x_glyph_draw (tg->rune, col, row, attr, tg->fg, tg->bg);
+    x_glyph_draw (tg, col, row, attr, tg->fg, tg->bg);
 }
  
 void
-x_cursor_draw (Rune rune, GlyphAttribute attr, uint col, uint row)
+x_cursor_draw (const TermGlyph *tg, uint col, uint row)
 {
+    TermGlyph cell;
     Color* drawcol;
+    GlyphAttribute attr;
     uint fg, bg;
 
     /* hidden cursor? */
     if ( twin_flag (MODE_HIDE) )
         return;
 
-    /* Select the right color for the right mode. */
-    drawcol = (Color *) dc.clrcache.items;
+    /* Select the right color for the right mode: the cache keeps the
+     * colours of the normal screen, the reverse ones are resolved. */
     fg = t_selected (col, row);  /* $fg_g used as a temp */
 
     if ( twin_flag (MODE_REVERSE))
-        drawcol += fg ? DEFAULT_CS : DEFAULT_RCS;
+        bg = x_color_resolve (fg ? DEFAULT_CS : DEFAULT_RCS);
     else
-        drawcol += fg ? DEFAULT_RCS : DEFAULT_CS;
+        bg = x_color_resolve (fg ? DEFAULT_RCS : DEFAULT_CS);
+
+    drawcol = (Color *) dc.clrcache.items + bg;
 
     /* inactive window? */
     if ( !twin_flag (MODE_FOCUSED) ) {
         x_cursor_draw_inactive (drawcol, col, row);
+        x_damage_add (BORDERPX + col * tw.cw, BORDERPY + row * tw.ch, tw.cw, tw.ch);
         return;
     }
 
     /* non glyph cursor? */
-    if ( x_cursor_draw_non_glyph (drawcol, col, row) )
+    if ( x_cursor_draw_non_glyph (drawcol, col, row) ) {
+        x_damage_add (BORDERPX + col * tw.cw, BORDERPY + row * tw.ch, tw.cw, tw.ch);
         return;
+    }
 
-    attr &= ATTR_BOLD | ATTR_ITALIC | ATTR_UNDERLINE | ATTR_STRUCK | ATTR_WIDE;
+    cell = *tg;
+    attr = tg->attr & (ATTR_BOLD | ATTR_ITALIC | ATTR_UNDERLINE | ATTR_STRUCK | ATTR_WIDE);
 
     if ( twin_flag (MODE_REVERSE)) {
         attr |= ATTR_REVERSE;
@@ -2006,13 +3853,15 @@ x_cursor_draw (Rune rune, GlyphAttribute attr, uint col, uint row)
     
     switch (tw.cursor) {
         case 7: /* st extension */
-            rune = 0x2603; /* snowman (U+2603) */
+            cell.rune = 0x2603; /* snowman (U+2603) */
+            cell.cluster = 0;
             /* FALLTHROUGH */
 
         case 0: /* Blinking Block */
         case 1: /* Blinking Block (Default) */
         case 2: /* Steady Block */
-            x_glyph_draw (rune, col, row, attr, fg, bg);
+            cell.attr = attr;
+            x_glyph_draw (&cell, col, row, attr, fg, bg);
             break;
     }
 }
@@ -2048,13 +3897,23 @@ x_get_title_atom (Atom atom)
 char *
 x_get_icon_title (void)
 {
-    return x_get_title_atom (xw.netwmiconname);
+    char *title;
+
+    tty_x_lock ();
+    title = x_get_title_atom (xw.netwmiconname);
+    tty_x_unlock ();
+    return title;
 }
 
 char *
 x_get_title (void)
 {
-    return x_get_title_atom (xw.netwmname);
+    char *title;
+
+    tty_x_lock ();
+    title = x_get_title_atom (xw.netwmname);
+    tty_x_unlock ();
+    return title;
 }
 
 int
@@ -2071,26 +3930,36 @@ int
 x_set_icon_title (const char *p)
 {
     XTextProperty prop;
+    int ret;
 
-    if ( x_set_title_atom (p, &prop, xw.netwmiconname ) != 0 )
-        return 1;
+    tty_x_lock ();
 
-    XSetWMIconName (xw.dpy, xw.tw, &prop);
-    XFree(prop.value);
-    return 0;
+    ret = x_set_title_atom (p, &prop, xw.netwmiconname ) != 0;
+    if ( !ret ) {
+        XSetWMIconName (xw.dpy, xw.tw, &prop);
+        XFree(prop.value);
+    }
+
+    tty_x_unlock ();
+    return ret;
 }
 
 int
 x_set_title (const char *p)
 {
     XTextProperty prop;
+    int ret;
 
-    if ( x_set_title_atom (p, &prop, xw.netwmname ) != 0 )
-        return 1;
+    tty_x_lock ();
 
-    XSetWMName(xw.dpy, xw.tw, &prop);
-    XFree(prop.value);
-    return 0;
+    ret = x_set_title_atom (p, &prop, xw.netwmname ) != 0;
+    if ( !ret ) {
+        XSetWMName(xw.dpy, xw.tw, &prop);
+        XFree(prop.value);
+    }
+
+    tty_x_unlock ();
+    return ret;
 }
 #endif  /* FEATURE_TITLE */
 
@@ -2100,17 +3969,32 @@ x_is_mode_visible (void)
     return twin_flag (MODE_VISIBLE);
 }
 
+/* a style run of x_line_draw: $len cells from $tg */
+void
+x_line_draw_run (const XftGlyphFontSpec *specs, uint nspecs, uint ncells,
+        const TermGlyph *tg, uint len, uint col, uint row,
+        GlyphAttribute attr, uint fg, uint bg)
+{
+#ifdef FEATURE_HARFBUZZ
+    specs = x_glyph_shape (specs, &nspecs, tg, len, col, row);
+#endif  /* FEATURE_HARFBUZZ */
+    x_glyph_draw_font_specs (specs, nspecs, ncells, col, row, attr, fg, bg, False);
+}
+
 void
 x_line_draw (Line line, uint row, uint col1, uint col2, uint sel)
 {
-    uint numspecs, cntspecs, base_col, cmin, cmax;
+    uint numspecs, cntspecs, cntcells, base_col, cmin, cmax;
     uint cur_fg, cur_bg, base_fg, base_bg;
     XftGlyphFontSpec *specs;
     GlyphAttribute cur_attr, base_attr;
+    Line base;
    
     specs = xw.specbuf;
     line += col1;
     numspecs = x_glyph_make_font_specs (specs, line, col2 - col1, col1, row);
+    dc.batch.cells += col2 - col1;
+    dc.batch.made += numspecs;
 
     /* selection */
     if ( sel )
@@ -2131,8 +4015,10 @@ x_line_draw (Line line, uint row, uint col1, uint col2, uint sel)
         base_fg = line->fg;
         base_bg = line->bg;
 
+        base = line;
         base_col = col1;
-        cntspecs = 1;
+        cntcells = 1;
+        cntspecs = x_glyph_nspecs (line);
         goto process;
     }
 
@@ -2162,41 +4048,92 @@ process:
         if ( cur_attr == base_attr &&
              cur_fg == base_fg &&
              cur_bg == base_bg ) {
-            cntspecs++;
+            cntcells++;
+            cntspecs += x_glyph_nspecs (line);
             continue;
         }
 
         /* draw glyphs with same style */
-        x_glyph_draw_font_specs (specs, cntspecs, base_col, row,
-                                base_attr, base_fg, base_bg);
+        x_line_draw_run (specs, cntspecs, cntcells, base, col1 - base_col,
+                         base_col, row, base_attr, base_fg, base_bg);
 
         /* update glyph buffer */
         specs += cntspecs;
         numspecs -= cntspecs;
-        cntspecs = 1;
+        cntcells = 1;
+        cntspecs = x_glyph_nspecs (line);
 
         base_attr = cur_attr;
         base_fg = cur_fg;
         base_bg = cur_bg;
+        base = line;
         base_col = col1;
     }
 
     /* draw remaining glyphs */
-    x_glyph_draw_font_specs (specs, cntspecs, base_col, row,
-                             base_attr, base_fg, base_bg);
+    x_line_draw_run (specs, cntspecs, cntcells, base, col1 - base_col,
+                     base_col, row, base_attr, base_fg, base_bg);
+}
+
+void
+x_scroll (uint top, uint bottom, int n)
+{
+    int src, dst, height;
+
+    /* rows [$top, $bottom] are shifted up ($n > 0) or down ($n < 0) */
+    if ( n > 0 ) {
+        src = top + n;
+        dst = top;
+    } else {
+        src = top;
+        dst = top - n;
+        n = -n;
+    }
+    height = (bottom - top + 1 - n) * tw.ch;
+    if ( height <= 0 )
+        return;
+
+#ifdef FEATURE_SHM
+    if ( xw.soft )
+        soft_copy_rows (BORDERPY + src * tw.ch, BORDERPY + dst * tw.ch, height);
+    else
+#endif  /* FEATURE_SHM */
+    XCopyArea (xw.dpy, xw.buf, xw.buf, dc.gc,
+               0, BORDERPY + src * tw.ch,
+               tw.w, height,
+               0, BORDERPY + dst * tw.ch);
+    x_damage_add (0, BORDERPY + dst * tw.ch, tw.w, height);
 }
 
 void
 x_draw_finish (void)
 {
     Color *c;
+    XRectangle *r;
+    uint i;
+
+    x_frame_flush ();
 
-    /* we don't need to handle MODE_REVERSE because the colors are swapped in
-     * this mode */
-    c = (Color *) dc.clrcache.items + DEFAULT_BG;
+    c = (Color *) dc.clrcache.items + x_color_resolve (DEFAULT_BG);
 
-    XCopyArea (xw.dpy, xw.buf, xw.tw, dc.gc, 0, 0, tw.w, tw.h, 0, 0);
+    /* copy the damaged regions only */
+    if ( xw.damage.full )
+        x_buf_put (0, 0, tw.w, tw.h);
+    else {
+        for ( i = xw.damage.n, r = xw.damage.rects; i != 0; i--, r++ )
+            x_buf_put (r->x, r->y, r->width, r->height);
+    }
+    x_buf_sync ();
     XSetForeground (xw.dpy, dc.gc, c->pixel);
+
+    /* reset */
+    xw.damage.n = 0;
+    xw.damage.area = 0;
+    xw.damage.full = False;
+    xw.stale = False;
+
+    /* the fonts of this frame may be closed now */
+    dc.frame++;
 }
 
 void
@@ -2214,7 +4151,17 @@ x_im_spot(int col, int row)
 void
 expose (XEvent *ev)
 {
-    t_draw (True);
+    XExposeEvent *e = &ev->xexpose;
+
+    /* the buffer is out of date (resize, palette): redraw everything */
+    if ( xw.stale ) {
+        t_draw (True);
+        return;
+    }
+
+    /* otherwise the buffer holds the exact image */
+    x_buf_put (e->x, e->y, e->width, e->height);
+    x_buf_sync ();
 }
 
 void
@@ -2234,6 +4181,8 @@ unmap (XEvent *ev)
 void
 x_set_pointer_motion (int set)
 {
+    tty_x_lock ();
+
     MODBIT (xw.attrs.event_mask, set, PointerMotionMask);
     XChangeWindowAttributes (xw.dpy, xw.tw, CWEventMask, &xw.attrs);
 
@@ -2241,6 +4190,8 @@ x_set_pointer_motion (int set)
         XUndefineCursor (xw.dpy, xw.tw);
     else
         XDefineCursor (xw.dpy, xw.tw, xw.cursor);
+
+    tty_x_unlock ();
 }
 
 void
@@ -2248,14 +4199,19 @@ x_set_mode (int set, uint flags)
 {
     TermWindowFlags oldflags;
    
+    tty_x_lock ();
+
     oldflags = tw.flags;
     MODBIT (tw.flags, set, flags);
 
     if ( twin_flag (MODE_REVERSE) != (oldflags & MODE_REVERSE) ) {
-        /* re-create all true colors and redraw */
-        x_colors_reverse ();
-        t_draw (True);
+        /* the colours are resolved while drawing: redraw everything with
+         * the next frame */
+        x_buf_stale ();
+        t_recolor (DEFAULT_BG);
     }
+
+    tty_x_unlock ();
 }
 
 int
@@ -2264,7 +4220,9 @@ x_set_cursor (int cursor)
     if (!BETWEEN(cursor, 0, 7))  /* 7: st extension */
         return 1;
     
+    tty_x_lock ();
     tw.cursor = cursor;
+    tty_x_unlock ();
     return 0;
 }
 
@@ -2281,10 +4239,14 @@ x_set_urgency (int add)
 void
 x_bell (void)
 {
+    tty_x_lock ();
+
     if ( !(twin_flag (MODE_FOCUSED)) )
         x_set_urgency (True);
     if ( BELL_VOLUME )
         XkbBell (xw.dpy, xw.tw, BELL_VOLUME, (Atom)NULL);
+
+    tty_x_unlock ();
 }
 
 void
@@ -2437,7 +4399,7 @@ run (const char **argv, uint argn)
 {
     XEvent ev;
     fd_set rfd;
-    int w, h, xfd, ttyfd, xev, dratwg, ttypending;
+    int w, h, xfd, ttyfd, xev, dratwg, ttypending, prewarm, ret;
     struct timespec seltv, *tv, now, lastblink, trigger;
     double timeout;
     EventHandler eh;
@@ -2465,7 +4427,7 @@ run (const char **argv, uint argn)
     ttyfd = tty_new (argv, argn);
     cresize (w, h);
 
-    for (timeout = -1, dratwg = False, lastblink = (struct timespec){0};;) {
+    for (timeout = -1, dratwg = False, lastblink = trigger = (struct timespec){0};;) {
         FD_ZERO(&rfd);
         FD_SET(ttyfd, &rfd);
         FD_SET(xfd, &rfd);
@@ -2480,7 +4442,20 @@ run (const char **argv, uint argn)
         seltv.tv_nsec = 1E6 * (timeout - 1E3 * seltv.tv_sec);
         tv = timeout >= 0 ? &seltv : NULL;
 
-        if (pselect(MAX(xfd, ttyfd) + 1, &rfd, NULL, NULL, tv, NULL) < 0) {
+        /* nothing to wait for: warm the glyph caches up a slice at a time
+         * and only poll, input is handled between the slices */
+        prewarm = tv == NULL && x_prewarm ();
+        if ( prewarm ) {
+            seltv.tv_sec = 0;
+            seltv.tv_nsec = 0;
+            tv = &seltv;
+        }
+
+        /* the tty is parsed while the loop waits */
+        tty_unlock ();
+        ret = pselect(MAX(xfd, ttyfd) + 1, &rfd, NULL, NULL, tv, NULL);
+        tty_lock ();
+        if ( ret < 0 ) {
             if (errno == EINTR)
                 continue;
             error ("select failed: %s", strerror(errno));
@@ -2510,6 +4485,12 @@ run (const char **argv, uint argn)
             if ( eh != NULL )
                 eh (&ev);
         }
+
+        /* the prewarm pass found nothing to handle: nothing to draw */
+        if ( prewarm && !ttypending && !xev ) {
+            XFlush (xw.dpy);
+            continue;
+        }
         /* To reduce flicker and tearing, when new content or event
          * triggers dratwg, we first wait a bit to ensure we got
          * everything, and if nothing new arrives - we draw.
@@ -2525,7 +4506,9 @@ run (const char **argv, uint argn)
                 dratwg = True;
             }
             timeout = (LATENCY_MAX - TIMEDIFF(now, trigger)) / LATENCY_MAX * LATENCY_MIN;
-            if (timeout > 0)
+            /* a cursor move only (e.g. arrow keys in a shell) can't
+             * tear: draw it right away */
+            if (timeout > 0 && t_is_dirty ())
                 continue;  /* we have time, try to find idle */
         }
         
@@ -2570,6 +4553,7 @@ usage (void)
         "    --version | -V             print program version\n"
         "    --raw | -r                 raw output\n"
         "    --verbose | -v\n"
+        "    --stats                    print load times and cache statistics\n"
 #ifdef FEATURE_TITLE
         "    --title=<title>\n"
 #endif        
@@ -2658,8 +4642,10 @@ main(int argc, char *argv[])
    
     /* init thunks */
     t_init ();
-    thunk_create (&dc.clrcache, MAX_INDEX_CACHE, sizeof (Color));
+    thunk_create (&dc.clrcache, TRUECOLOR_BASE, sizeof (Color));
+    thunk_create (&dc.truecolor.free, 0, sizeof (uint));
     thunk_create (&dc.fntcache, 0, sizeof (Fontcache));
+    x_frame_init ();
 
     /* create and run */
     t_new (cols, rows);
@@ -40,9 +40,12 @@ typedef enum {
 
 void x_bell (void);
 void x_clip_copy (void);
-void x_cursor_draw (Rune rune, GlyphAttribute attr, uint col, uint row);
+void x_cursor_draw (const TermGlyph *tg, uint col, uint row);
 void x_cursor_remove (TermGlyph *tg, uint col, uint row);
 void x_line_draw (Line, uint, uint, uint, uint);
+void x_scroll (uint top, uint bottom, int n);
+void x_screen_save (void);
+int x_screen_restore (void);
 void x_draw_finish (void);
 
 /* color */
@@ -60,6 +63,11 @@ int x_is_mode_visible (void);
 void x_im_spot (int, int);
 void x_free (void);
 
+#ifdef FEATURE_HARFBUZZ
+void x_glyph_shape_break (uint col, uint row);
+int x_glyph_shape_extent (Line line, uint col, uint *col1, uint *col2);
+#endif  /* FEATURE_HARFBUZZ */
+
 #ifdef FEATURE_TITLE
 int x_set_title (const char *);
 int x_set_icon_title (const char *);